@@ -0,0 +1,201 @@
+#include <irods/rodsLog.h>
+#include <irods/rodsErrorTable.h>
+#include <irods/irods_exception.hpp>
+
+#include <nlohmann/json.hpp>
+#include <fmt/format.h>
+
+#include <sys/file.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <cerrno>
+#include <filesystem>
+#include <fstream>
+
+#include "access_time_utilities.hpp"
+
+namespace {
+
+    namespace fs = std::filesystem;
+
+    // opens and exclusively locks the spool, reopening it if it was moved aside
+    // by a flush while this agent waited for the lock
+    auto open_and_lock_spool(const std::string& _spool) -> int
+    {
+        while(true) {
+            const auto fd = open(_spool.c_str(), O_WRONLY | O_APPEND | O_CREAT, 0600);
+            if(fd < 0) {
+                THROW(UNIX_FILE_OPEN_ERR - errno, fmt::format("failed to open access time spool [{}]", _spool));
+            }
+
+            if(flock(fd, LOCK_EX) < 0) {
+                close(fd);
+                THROW(UNIX_FILE_OPEN_ERR - errno, fmt::format("failed to lock access time spool [{}]", _spool));
+            }
+
+            struct stat opened{}, current{};
+            if(0 == fstat(fd, &opened) && 0 == stat(_spool.c_str(), &current) &&
+               opened.st_ino == current.st_ino && opened.st_dev == current.st_dev) {
+                return fd;
+            }
+
+            close(fd);
+        }
+    } // open_and_lock_spool
+
+    void read_spool(const std::string& _path, irods::access_time_map& _entries)
+    {
+        std::ifstream in{_path};
+        std::string line{};
+        while(std::getline(in, line)) {
+            const auto j = nlohmann::json::parse(line, nullptr, false);
+            if(j.is_discarded() || !j.is_object()) {
+                rodsLog(LOG_NOTICE, "skipping malformed entry in access time spool [%s]", _path.c_str());
+                continue;
+            }
+
+            // a line cut short by an agent which exited while appending is skipped rather
+            // than preventing the remaining entries from being applied
+            try {
+                const auto time = j.at("time").get<std::time_t>();
+
+                auto& t = _entries[{j.at("attribute").get<std::string>(), j.at("logical_path").get<std::string>()}];
+                t = std::max(t, time);
+            }
+            catch(const nlohmann::json::exception&) {
+                rodsLog(LOG_NOTICE, "skipping malformed entry in access time spool [%s]", _path.c_str());
+            }
+        }
+    } // read_spool
+
+} // namespace
+
+namespace irods {
+
+    access_time_write_behind::~access_time_write_behind()
+    {
+        try {
+            std::lock_guard lk{mutex_};
+            write_locked();
+        }
+        catch(const irods::exception& e) {
+            rodsLog(LOG_ERROR, "%s", e.client_display_what());
+        }
+    } // dtor
+
+    void access_time_write_behind::record(
+          const std::string& _spool
+        , const std::string& _attribute
+        , const std::string& _logical_path
+        , std::time_t        _time
+        , uint32_t           _maximum_entries
+        , uint32_t           _maximum_seconds)
+    {
+        std::lock_guard lk{mutex_};
+
+        // entries buffered for another spool are written to it first
+        if(!spool_.empty() && spool_ != _spool) {
+            write_locked();
+        }
+
+        spool_ = _spool;
+
+        auto& t = entries_[{_attribute, _logical_path}];
+        t = std::max(t, _time);
+
+        if(entries_.size() >= _maximum_entries || _time - last_write_ >= _maximum_seconds) {
+            write_locked();
+        }
+    } // record
+
+    void access_time_write_behind::write()
+    {
+        std::lock_guard lk{mutex_};
+        write_locked();
+    } // write
+
+    void access_time_write_behind::write_locked()
+    {
+        last_write_ = std::time(nullptr);
+
+        if(entries_.empty()) {
+            return;
+        }
+
+        append_to_access_time_spool(spool_, entries_);
+        entries_.clear();
+    } // write_locked
+
+    void append_to_access_time_spool(const std::string& _spool, const access_time_map& _entries)
+    {
+        std::string buffer{};
+        for(const auto& [key, time] : _entries) {
+            buffer += nlohmann::json{
+                          {"attribute",    key.first}
+                        , {"logical_path", key.second}
+                        , {"time",         time}}.dump();
+            buffer += '\n';
+        }
+
+        const auto fd = open_and_lock_spool(_spool);
+
+        const char* p = buffer.data();
+        auto remaining = buffer.size();
+        while(remaining > 0) {
+            const auto n = ::write(fd, p, remaining);
+            if(n < 0) {
+                if(EINTR == errno) {
+                    continue;
+                }
+
+                const auto ec = errno;
+                close(fd);
+                THROW(UNIX_FILE_WRITE_ERR - ec, fmt::format("failed to write access time spool [{}]", _spool));
+            }
+
+            p         += n;
+            remaining -= n;
+        }
+
+        // closing the descriptor releases the lock
+        close(fd);
+
+    } // append_to_access_time_spool
+
+    auto take_access_time_spool(const std::string& _spool) -> std::pair<access_time_map, std::vector<std::string>>
+    {
+        const fs::path spool{_spool};
+        const auto prefix = spool.filename().string() + ".";
+
+        if(fs::exists(spool)) {
+            const auto fd = open_and_lock_spool(_spool);
+
+            const auto moved = fmt::format("{}.{}.{}", _spool, std::time(nullptr), getpid());
+            if(rename(_spool.c_str(), moved.c_str()) < 0) {
+                const auto ec = errno;
+                close(fd);
+                THROW(UNIX_FILE_RENAME_ERR - ec, fmt::format("failed to move access time spool [{}]", _spool));
+            }
+
+            close(fd);
+        }
+
+        access_time_map          entries{};
+        std::vector<std::string> files{};
+
+        for(const auto& e : fs::directory_iterator{spool.has_parent_path() ? spool.parent_path() : fs::path{"."}}) {
+            const auto name = e.path().filename().string();
+            if(0 == name.rfind(prefix, 0)) {
+                read_spool(e.path().string(), entries);
+                files.push_back(e.path().string());
+            }
+        }
+
+        return {entries, files};
+
+    } // take_access_time_spool
+
+} // namespace irods
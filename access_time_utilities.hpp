@@ -0,0 +1,61 @@
+#ifndef IRODS_ACCESS_TIME_UTILITIES_HPP
+#define IRODS_ACCESS_TIME_UTILITIES_HPP
+
+#include <cstdint>
+#include <ctime>
+#include <map>
+#include <mutex>
+#include <string>
+#include <utility>
+#include <vector>
+
+namespace irods {
+
+    // the latest access time for each attribute and logical path
+    using access_time_map = std::map<std::pair<std::string, std::string>, std::time_t>;
+
+    // holds access times within the agent, keeping the latest time for each object, and
+    // appends them to a host local spool file once the buffer holds a number of entries,
+    // once a number of seconds have passed, or when the agent exits.  no catalog write
+    // is made, the spool is applied to the catalog by flush_access_time_spool
+    class access_time_write_behind {
+    public:
+        access_time_write_behind() = default;
+        ~access_time_write_behind();
+
+        access_time_write_behind(const access_time_write_behind&) = delete;
+        access_time_write_behind& operator=(const access_time_write_behind&) = delete;
+
+        void record(
+              const std::string& _spool
+            , const std::string& _attribute
+            , const std::string& _logical_path
+            , std::time_t        _time
+            , uint32_t           _maximum_entries
+            , uint32_t           _maximum_seconds);
+
+        // appends all buffered entries to the spool
+        void write();
+
+    private:
+        // mutex_ must be held by the caller
+        void write_locked();
+
+        std::mutex      mutex_;
+        std::string     spool_{};
+        access_time_map entries_{};
+        std::time_t     last_write_{std::time(nullptr)};
+
+    }; // class access_time_write_behind
+
+    // appends entries to the spool under an exclusive lock, one line per entry
+    void append_to_access_time_spool(const std::string& _spool, const access_time_map& _entries);
+
+    // moves the spool aside and returns the latest time for each object from it and from
+    // any spool moved aside by an earlier flush which did not complete.  the returned
+    // names of the moved spool files are to be removed once the entries are applied
+    auto take_access_time_spool(const std::string& _spool) -> std::pair<access_time_map, std::vector<std::string>>;
+
+} // namespace irods
+
+#endif // IRODS_ACCESS_TIME_UTILITIES_HPP
@@ -0,0 +1,70 @@
+#ifndef IRODS_POLICY_ENGINE_CATALOG_BATCH_HPP
+#define IRODS_POLICY_ENGINE_CATALOG_BATCH_HPP
+
+#include <irods/filesystem.hpp>
+
+#include <fmt/format.h>
+
+#include <algorithm>
+#include <cstdint>
+#include <map>
+#include <string>
+#include <vector>
+
+// Batches the data objects named by a list of logical paths into general queries, one
+// query per collection and batch rather than one per object:
+//
+// pe::for_each_name_batch(logical_paths, 100, [&](const auto& coll_name, const auto& in_list) {
+//     irods::query<rsComm_t> qobj{comm, fmt::format(
+//         "SELECT DATA_NAME, DATA_SIZE WHERE COLL_NAME = '{}' AND DATA_NAME IN ({})"
+//         , coll_name
+//         , in_list)};
+// });
+
+namespace irods::policy_composition::policy_engine {
+
+    // a general query has no escape for a single quote within a quoted value, so a path
+    // holding one cannot be named within a condition
+    auto name_can_be_queried(const std::string& _logical_path) -> bool
+    {
+        return std::string::npos == _logical_path.find('\'');
+    } // name_can_be_queried
+
+    // calls the function with a collection name and a quoted list of up to batch_size
+    // data names within that collection, for use within a DATA_NAME IN clause.  paths
+    // which cannot be queried are left out, callers are expected to count them as failed
+    template<typename Function>
+    void for_each_name_batch(
+          const std::vector<std::string>& _logical_paths
+        , uint32_t                        _batch_size
+        , Function                        _function)
+    {
+        using fsp = irods::experimental::filesystem::path;
+
+        const auto batch_size = std::max<uint32_t>(_batch_size, 1);
+
+        std::map<std::string, std::vector<std::string>> names{};
+        for(const auto& lp : _logical_paths) {
+            if(!name_can_be_queried(lp)) {
+                continue;
+            }
+
+            fsp path{lp};
+            names[path.parent_path().string()].push_back(path.object_name().string());
+        }
+
+        for(const auto& [coll_name, data_names] : names) {
+            for(std::size_t i = 0; i < data_names.size(); i += batch_size) {
+                std::string in_list{};
+                for(std::size_t j = i; j < std::min<std::size_t>(i + batch_size, data_names.size()); ++j) {
+                    in_list += fmt::format("{}'{}'", in_list.empty() ? "" : ", ", data_names[j]);
+                }
+
+                _function(coll_name, in_list);
+            }
+        }
+    } // for_each_name_batch
+
+} // namespace irods::policy_composition::policy_engine
+
+#endif // IRODS_POLICY_ENGINE_CATALOG_BATCH_HPP
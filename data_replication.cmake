@@ -22,6 +22,7 @@ add_library(
     ${TARGET_NAME}
     MODULE
     ${CMAKE_SOURCE_DIR}/lib${TARGET_NAME}.cpp
+    ${CMAKE_SOURCE_DIR}/${POLICY_NAME}_utilities.cpp
     )
 
 target_include_directories(
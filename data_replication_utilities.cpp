@@ -0,0 +1,692 @@
+#include <irods/rodsLog.h>
+#include <irods/rodsErrorTable.h>
+#include <irods/irods_exception.hpp>
+#include <irods/irods_query.hpp>
+#include <irods/irods_configuration_keywords.hpp>
+#include <irods/irods_hasher_factory.hpp>
+#include <irods/irods_resource_backport.hpp>
+#include <irods/physPath.hpp>
+#include <irods/rsFileOpen.hpp>
+#include <irods/rsFileRead.hpp>
+#include <irods/rsFileWrite.hpp>
+#include <irods/rsFileLseek.hpp>
+#include <irods/rsFileClose.hpp>
+#include <irods/rsFileTruncate.hpp>
+#include <irods/rsModDataObjMeta.hpp>
+#include <irods/rsFileChksum.hpp>
+#include <irods/rsExecMyRule.hpp>
+#include <irods/msParam.h>
+#include <irods/execCmd.h>
+#include <irods/SHA256Strategy.hpp>
+
+#include <boost/algorithm/string.hpp>
+#include <nlohmann/json.hpp>
+
+#include <fmt/format.h>
+
+#include <sys/file.h>
+#include <fcntl.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <atomic>
+#include <cerrno>
+#include <chrono>
+#include <cstdio>
+#include <ctime>
+#include <filesystem>
+#include <thread>
+#include <vector>
+
+#include "data_replication_utilities.hpp"
+
+namespace {
+
+    namespace fs = std::filesystem;
+
+    const auto poll_interval = std::chrono::milliseconds(100);
+
+    const std::string block_digests_kw{"block_digests"};
+
+    auto open_lock_file(const std::string& _directory, const std::string& _name, int _flags) -> int
+    {
+        std::error_code ec{};
+        fs::create_directories(_directory, ec);
+
+        const auto path = (fs::path{_directory} / _name).string();
+
+        const auto fd = open(path.c_str(), _flags | O_CREAT, 0600);
+        if(fd < 0) {
+            THROW(UNIX_FILE_OPEN_ERR - errno, fmt::format("failed to open replication lock file [{}]", path));
+        }
+
+        return fd;
+
+    } // open_lock_file
+
+    // the host of the server holding the replica
+    auto get_replica_location(const irods::replica_info& _replica) -> std::string
+    {
+        std::string location{};
+        if(const auto err = irods::get_loc_for_hier_string(_replica.hierarchy, location); !err.ok()) {
+            THROW(err.code(), fmt::format("get_loc_for_hier_string failed for [{}] msg [{}]", _replica.hierarchy, err.result()));
+        }
+
+        return location;
+
+    } // get_replica_location
+
+    auto make_file_open_input(
+          const std::string&         _logical_path
+        , const irods::replica_info& _replica) -> fileOpenInp_t
+    {
+        const auto location = get_replica_location(_replica);
+
+        fileOpenInp_t inp{};
+        rstrcpy(inp.addr.hostAddr, location.c_str(),               NAME_LEN);
+        rstrcpy(inp.resc_hier_,    _replica.hierarchy.c_str(),     MAX_NAME_LEN);
+        rstrcpy(inp.objPath,       _logical_path.c_str(),          MAX_NAME_LEN);
+        rstrcpy(inp.fileName,      _replica.physical_path.c_str(), MAX_NAME_LEN);
+        inp.mode = getDefFileMode();
+
+        return inp;
+
+    } // make_file_open_input
+
+    // a physical file opened through the resource plugin interface of its hierarchy
+    class physical_file {
+    public:
+        physical_file(
+              rsComm_t&                  _comm
+            , const std::string&         _logical_path
+            , const irods::replica_info& _replica
+            , int                        _flags)
+            : comm_{_comm}
+            , path_{_replica.physical_path}
+        {
+            auto inp  = make_file_open_input(_logical_path, _replica);
+            inp.flags = _flags;
+
+            fd_ = rsFileOpen(&comm_, &inp);
+            clearKeyVal(&inp.condInput);
+
+            if(fd_ < 0) {
+                THROW(fd_, fmt::format("failed to open [{}]", path_));
+            }
+        } // ctor
+
+        ~physical_file()
+        {
+            fileCloseInp_t inp{};
+            inp.fileInx = fd_;
+            rsFileClose(&comm_, &inp);
+        } // dtor
+
+        physical_file(const physical_file&) = delete;
+        physical_file& operator=(const physical_file&) = delete;
+
+        void seek(rodsLong_t _offset)
+        {
+            fileLseekInp_t inp{};
+            inp.fileInx = fd_;
+            inp.offset  = _offset;
+            inp.whence  = SEEK_SET;
+
+            fileLseekOut_t* out{};
+            const auto ret = rsFileLseek(&comm_, &inp, &out);
+            free(out);
+
+            if(ret < 0) {
+                THROW(ret, fmt::format("failed to seek [{}] to [{}]", path_, _offset));
+            }
+        } // seek
+
+        // reads until the buffer is full or the end of the file, returns the bytes read
+        auto read(std::vector<char>& _buffer, int _length) -> int
+        {
+            int total{};
+            while(total < _length) {
+                fileReadInp_t inp{};
+                inp.fileInx = fd_;
+                inp.len     = _length - total;
+
+                bytesBuf_t buf{};
+                buf.buf = _buffer.data() + total;
+                buf.len = inp.len;
+
+                const auto ret = rsFileRead(&comm_, &inp, &buf);
+                if(ret < 0) {
+                    THROW(ret, fmt::format("failed to read [{}]", path_));
+                }
+
+                if(0 == ret) {
+                    break;
+                }
+
+                total += ret;
+            }
+
+            return total;
+        } // read
+
+        void write(std::vector<char>& _buffer, int _length)
+        {
+            int total{};
+            while(total < _length) {
+                fileWriteInp_t inp{};
+                inp.fileInx = fd_;
+                inp.len     = _length - total;
+
+                bytesBuf_t buf{};
+                buf.buf = _buffer.data() + total;
+                buf.len = inp.len;
+
+                const auto ret = rsFileWrite(&comm_, &inp, &buf);
+                if(ret <= 0) {
+                    THROW(ret < 0 ? ret : UNIX_FILE_WRITE_ERR, fmt::format("failed to write [{}]", path_));
+                }
+
+                total += ret;
+            }
+        } // write
+
+    private:
+        rsComm_t&         comm_;
+        const std::string path_;
+        int               fd_{-1};
+
+    }; // class physical_file
+
+    auto block_count(rodsLong_t _size, int _block_size) -> std::size_t
+    {
+        return static_cast<std::size_t>((_size + _block_size - 1) / _block_size);
+    } // block_count
+
+    // the digests are returned within the output of the rule as <token:digest,...>, the
+    // token of the request distinguishing them from any other output of the rule
+    auto parse_block_digests(const std::string& _output, const std::string& _token) -> std::vector<std::string>
+    {
+        const auto marker = fmt::format("<{}:", _token);
+
+        const auto begin = _output.find(marker);
+        const auto end   = std::string::npos == begin ? begin : _output.find('>', begin);
+        if(std::string::npos == end) {
+            THROW(SYS_INVALID_INPUT_PARAM, "block digests not found within rule output");
+        }
+
+        std::vector<std::string> digests{};
+        const auto list = _output.substr(begin + marker.size(), end - begin - marker.size());
+        if(!list.empty()) {
+            boost::split(digests, list, boost::is_any_of(","));
+        }
+
+        return digests;
+
+    } // parse_block_digests
+
+    // invokes the replication policy on the server holding the replica to compute the
+    // digests of its blocks there
+    auto request_block_digests(
+          rsComm_t&                        _comm
+        , const std::string&               _logical_path
+        , const irods::replica_info&       _replica
+        , int                              _block_size
+        , const irods::delta_sync_options& _options) -> std::vector<std::string>
+    {
+        static std::atomic<uint64_t> requests{};
+
+        const auto token = fmt::format("{}.{}", getpid(), requests++);
+
+        const auto rule = nlohmann::json{
+            {"policy_to_invoke", "irods_policy_execute_rule"},
+            {"parameters", {
+                {"policy_to_invoke", "irods_policy_data_replication"},
+                {"parameters", {
+                    {"logical_path", _logical_path},
+                    {block_digests_kw, {
+                        {"replica_number", _replica.replica_number},
+                        {"block_size",     _block_size},
+                        {"token",          token}}}}},
+                {"configuration", nlohmann::json::object()}}}}.dump();
+
+        if(rule.size() >= META_STR_LEN) {
+            THROW(SYS_INVALID_INPUT_PARAM, fmt::format("block digest request for [{}] is too long", _logical_path));
+        }
+
+        execMyRuleInp_t inp{};
+        rstrcpy(inp.myRule,         rule.c_str(),                          META_STR_LEN);
+        rstrcpy(inp.addr.hostAddr,  get_replica_location(_replica).c_str(), NAME_LEN);
+        rstrcpy(inp.outParamDesc,   "ruleExecOut",                         LONG_NAME_LEN);
+        addKeyVal(&inp.condInput, irods::KW_CFG_INSTANCE_NAME.c_str(), _options.policy_instance.c_str());
+
+        msParamArray_t inp_params{};
+        inp.inpParamArray = &inp_params;
+
+        msParamArray_t* out_params{};
+        const auto ret = rsExecMyRule(&_comm, &inp, &out_params);
+        clearKeyVal(&inp.condInput);
+
+        std::string output{};
+        if(out_params) {
+            if(const auto p = getMsParamByLabel(out_params, "ruleExecOut"); p && p->inOutStruct) {
+                const auto exec_out = static_cast<execCmdOut_t*>(p->inOutStruct);
+                if(exec_out->stdoutBuf.buf) {
+                    output.assign(static_cast<char*>(exec_out->stdoutBuf.buf), exec_out->stdoutBuf.len);
+                }
+            }
+
+            clearMsParamArray(out_params, 1);
+            free(out_params);
+        }
+
+        if(ret < 0) {
+            THROW(ret, fmt::format("failed to request block digests of replica [{}] of [{}] through [{}]"
+                                   , _replica.replica_number
+                                   , _logical_path
+                                   , _options.policy_instance));
+        }
+
+        return parse_block_digests(output, token);
+
+    } // request_block_digests
+
+    // the digests computed next to the replica.  if the policy cannot be invoked on that
+    // server the replica is read through this agent when the fallback is enabled, which
+    // is counted within the result, otherwise the sync fails
+    auto get_block_digests(
+          rsComm_t&                        _comm
+        , const std::string&               _logical_path
+        , const irods::replica_info&       _replica
+        , int                              _block_size
+        , const irods::delta_sync_options& _options
+        , irods::delta_sync_result&        _result) -> std::vector<std::string>
+    {
+        try {
+            return request_block_digests(_comm, _logical_path, _replica, _block_size, _options);
+        }
+        catch(const irods::exception& e) {
+            if(!_options.local_fallback) {
+                throw;
+            }
+
+            rodsLog(LOG_NOTICE,
+                    "irods_policy_data_replication - reading replica [%d] of [%s] through this agent [%s]",
+                    _replica.replica_number,
+                    _logical_path.c_str(),
+                    e.client_display_what());
+        }
+
+        ++_result.replicas_read_locally;
+
+        return irods::compute_block_digests(_comm, _logical_path, _replica, _block_size);
+
+    } // get_block_digests
+
+    // the status, modify time and size of a replica as currently recorded by the catalog
+    auto get_replica_state(
+          rsComm_t&                  _comm
+        , const irods::replica_info& _replica) -> std::vector<std::string>
+    {
+        const auto query_str = fmt::format(
+                                   "SELECT DATA_REPL_STATUS, DATA_MODIFY_TIME, DATA_SIZE WHERE DATA_ID = '{}' AND DATA_REPL_NUM = '{}'"
+                                   , _replica.data_id
+                                   , _replica.replica_number);
+
+        irods::query<rsComm_t> qobj{&_comm, query_str, 1};
+        if(0 == qobj.size()) {
+            return {};
+        }
+
+        return qobj.front();
+
+    } // get_replica_state
+
+    // computes the checksum of a replica on the server holding it, using the scheme of
+    // the given checksum if any
+    auto compute_replica_checksum(
+          rsComm_t&                  _comm
+        , const std::string&         _logical_path
+        , const irods::replica_info& _replica
+        , const std::string&         _scheme) -> std::string
+    {
+        fileChksumInp_t inp{};
+        inp.dataSize = _replica.size;
+        rstrcpy(inp.addr.hostAddr, get_replica_location(_replica).c_str(), NAME_LEN);
+        rstrcpy(inp.fileName,      _replica.physical_path.c_str(),        MAX_NAME_LEN);
+        rstrcpy(inp.rescHier,      _replica.hierarchy.c_str(),            MAX_NAME_LEN);
+        rstrcpy(inp.objPath,       _logical_path.c_str(),                 MAX_NAME_LEN);
+        rstrcpy(inp.orig_chksum,   _scheme.c_str(),                       CHKSUM_LEN);
+
+        char* checksum{};
+        if(const auto ret = rsFileChksum(&_comm, &inp, &checksum); ret < 0) {
+            THROW(ret, fmt::format("failed to compute checksum of [{}]", _replica.physical_path));
+        }
+
+        std::string result{checksum ? checksum : ""};
+        free(checksum);
+
+        return result;
+
+    } // compute_replica_checksum
+
+    void modify_replica(
+          rsComm_t&                  _comm
+        , const std::string&         _logical_path
+        , const irods::replica_info& _replica
+        , keyValPair_t&              _reg_param)
+    {
+        dataObjInfo_t info{};
+        rstrcpy(info.objPath,  _logical_path.c_str(),      MAX_NAME_LEN);
+        rstrcpy(info.rescHier, _replica.hierarchy.c_str(), MAX_NAME_LEN);
+        info.dataId  = _replica.data_id;
+        info.replNum = _replica.replica_number;
+
+        modDataObjMeta_t mod_inp{};
+        mod_inp.dataObjInfo = &info;
+        mod_inp.regParam    = &_reg_param;
+
+        const auto ret = rsModDataObjMeta(&_comm, &mod_inp);
+        clearKeyVal(&_reg_param);
+
+        if(ret < 0) {
+            THROW(ret, fmt::format("failed to update catalog for replica [{}] of [{}]", _replica.replica_number, _logical_path));
+        }
+
+    } // modify_replica
+
+    void set_replica_status(
+          rsComm_t&                  _comm
+        , const std::string&         _logical_path
+        , const irods::replica_info& _replica
+        , int                        _status)
+    {
+        keyValPair_t reg_param{};
+        addKeyVal(&reg_param, REPL_STATUS_KW, std::to_string(_status).c_str());
+
+        modify_replica(_comm, _logical_path, _replica, reg_param);
+
+    } // set_replica_status
+
+} // namespace
+
+namespace irods {
+
+    replication_slot::replication_slot(int _fd)
+        : fd_{_fd}
+    {
+    } // ctor
+
+    replication_slot::~replication_slot()
+    {
+        // closing the descriptor releases the lock
+        if(fd_ >= 0) {
+            close(fd_);
+        }
+    } // dtor
+
+    replication_slot::replication_slot(replication_slot&& _other) noexcept
+        : fd_{_other.fd_}
+    {
+        _other.fd_ = -1;
+    } // move ctor
+
+    replication_slot& replication_slot::operator=(replication_slot&& _other) noexcept
+    {
+        if(this != &_other) {
+            if(fd_ >= 0) {
+                close(fd_);
+            }
+
+            fd_        = _other.fd_;
+            _other.fd_ = -1;
+        }
+
+        return *this;
+    } // move assignment
+
+    auto acquire_replication_slot(
+          const std::string& _directory
+        , const std::string& _resource
+        , uint32_t           _maximum) -> replication_slot
+    {
+        // start at a different slot in each agent to spread the probing
+        const auto offset = static_cast<uint32_t>(getpid()) % std::max(_maximum, 1u);
+
+        while(true) {
+            for(uint32_t i = 0; i < _maximum; ++i) {
+                const auto name = fmt::format("{}.slot.{}", _resource, (offset + i) % _maximum);
+
+                const auto fd = open_lock_file(_directory, name, O_RDONLY);
+                if(0 == flock(fd, LOCK_EX | LOCK_NB)) {
+                    return replication_slot{fd};
+                }
+
+                close(fd);
+            }
+
+            std::this_thread::sleep_for(poll_interval);
+        }
+    } // acquire_replication_slot
+
+    void acquire_host_bandwidth(
+          const std::string& _directory
+        , const std::string& _resource
+        , double             _bytes_per_second
+        , rodsLong_t         _bytes)
+    {
+        using clock = std::chrono::steady_clock;
+
+        if(_bytes_per_second <= 0 || _bytes <= 0) {
+            return;
+        }
+
+        const auto capacity = _bytes_per_second;
+        const auto needed   = std::min(static_cast<double>(_bytes), capacity);
+
+        const auto fd = open_lock_file(_directory, fmt::format("{}.bandwidth", _resource), O_RDWR);
+
+        while(true) {
+            if(flock(fd, LOCK_EX) < 0) {
+                const auto ec = errno;
+                close(fd);
+                THROW(UNIX_FILE_OPEN_ERR - ec, fmt::format("failed to lock bandwidth file for resource [{}]", _resource));
+            }
+
+            // the state is the number of tokens and the time at which it was computed,
+            // an empty or unreadable file is a full bucket
+            char buffer[64]{};
+            double tokens{capacity};
+            long long last{};
+
+            const auto n = pread(fd, buffer, sizeof(buffer) - 1, 0);
+            if(n <= 0 || 2 != std::sscanf(buffer, "%lf %lld", &tokens, &last)) {
+                tokens = capacity;
+                last   = 0;
+            }
+
+            const auto now = std::chrono::duration_cast<std::chrono::nanoseconds>(clock::now().time_since_epoch()).count();
+            if(last > 0) {
+                tokens = std::min(capacity, tokens + _bytes_per_second * std::max(now - last, 0LL) / 1e9);
+            }
+
+            const auto admitted = tokens >= needed;
+            if(admitted) {
+                tokens -= static_cast<double>(_bytes);
+            }
+
+            const auto state = fmt::format("{} {}\n", tokens, now);
+            if(ftruncate(fd, 0) < 0 || pwrite(fd, state.data(), state.size(), 0) < 0) {
+                rodsLog(LOG_NOTICE, "failed to write bandwidth file for resource [%s]", _resource.c_str());
+            }
+
+            flock(fd, LOCK_UN);
+
+            if(admitted) {
+                close(fd);
+                return;
+            }
+
+            std::this_thread::sleep_for(std::chrono::duration<double>((needed - tokens) / _bytes_per_second));
+        }
+    } // acquire_host_bandwidth
+
+    auto compute_block_digests(
+          rsComm_t&           _comm
+        , const std::string&  _logical_path
+        , const replica_info& _replica
+        , rodsLong_t          _block_size) -> std::vector<std::string>
+    {
+        const auto block_size = static_cast<int>(std::clamp<rodsLong_t>(_block_size, 4096, 64 * 1024 * 1024));
+
+        physical_file file{_comm, _logical_path, _replica, O_RDONLY};
+
+        std::vector<char>        block(block_size);
+        std::vector<std::string> digests{};
+
+        while(true) {
+            const auto bytes = file.read(block, block_size);
+            if(0 == bytes) {
+                break;
+            }
+
+            irods::Hasher hasher{};
+            if(const auto err = irods::getHasher(irods::SHA256_NAME, hasher); !err.ok()) {
+                THROW(err.code(), err.result());
+            }
+
+            hasher.update(std::string(block.data(), bytes));
+
+            std::string digest{};
+            hasher.digest(digest);
+            digests.push_back(digest);
+
+            if(bytes < block_size) {
+                break;
+            }
+        }
+
+        return digests;
+
+    } // compute_block_digests
+
+    auto delta_sync_replica(
+          rsComm_t&                 _comm
+        , const std::string&        _logical_path
+        , const replica_info&       _source
+        , const replica_info&       _destination
+        , const delta_sync_options& _options) -> delta_sync_result
+    {
+        const auto block_size = static_cast<int>(std::clamp<rodsLong_t>(_options.block_size, 4096, 64 * 1024 * 1024));
+
+        // the source is not locked while it is read, a write to it in the meantime either
+        // leaves it intermediate or changes its modify time or size within the catalog
+        auto verify_source_unchanged = [&] {
+            const auto state = get_replica_state(_comm, _source);
+            if(state.size() < 3 ||
+               state[0] != std::to_string(GOOD_REPLICA) ||
+               state[1] != _source.modify_time ||
+               state[2] != std::to_string(_source.size)) {
+                THROW(SYS_REPLICA_INACCESSIBLE,
+                      fmt::format("replica [{}] of [{}] was modified during the sync", _source.replica_number, _logical_path));
+            }
+        };
+
+        delta_sync_result result{};
+
+        verify_source_unchanged();
+
+        // the replica is intermediate while it is written, it is marked directly within
+        // the catalog as opening it for write would stale the source once closed
+        set_replica_status(_comm, _logical_path, _destination, INTERMEDIATE_REPLICA);
+
+        try {
+            const auto src_digests = get_block_digests(_comm, _logical_path, _source,      block_size, _options, result);
+            const auto dst_digests = get_block_digests(_comm, _logical_path, _destination, block_size, _options, result);
+
+            if(src_digests.size() != block_count(_source.size, block_size)) {
+                THROW(SYS_COPY_LEN_ERR, fmt::format("size of [{}] does not match the catalog", _source.physical_path));
+            }
+
+            {
+                physical_file src{_comm, _logical_path, _source,      O_RDONLY};
+                physical_file dst{_comm, _logical_path, _destination, O_RDWR};
+
+                std::vector<char> block(block_size);
+
+                for(std::size_t i = 0; i < src_digests.size(); ++i) {
+                    const auto offset = static_cast<rodsLong_t>(i) * block_size;
+
+                    result.bytes_compared += std::min<rodsLong_t>(block_size, _source.size - offset);
+
+                    if(i < dst_digests.size() && src_digests[i] == dst_digests[i]) {
+                        continue;
+                    }
+
+                    src.seek(offset);
+                    const auto bytes = src.read(block, block_size);
+                    if(0 == bytes) {
+                        break;
+                    }
+
+                    dst.seek(offset);
+                    dst.write(block, bytes);
+
+                    result.bytes_written += bytes;
+                }
+            }
+
+            if(_destination.size > _source.size || dst_digests.size() > src_digests.size()) {
+                auto inp     = make_file_open_input(_logical_path, _destination);
+                inp.dataSize = _source.size;
+
+                const auto ret = rsFileTruncate(&_comm, &inp);
+                clearKeyVal(&inp.condInput);
+
+                if(ret < 0) {
+                    THROW(ret, fmt::format("failed to truncate [{}]", _destination.physical_path));
+                }
+            }
+
+            // the replica is only good once its bytes match those of the source as they
+            // are now, rather than as they were when the catalog checksum was computed
+            auto written = _destination;
+            written.size = _source.size;
+
+            const auto expected = compute_replica_checksum(_comm, _logical_path, _source, _source.checksum);
+            const auto computed = compute_replica_checksum(_comm, _logical_path, written, expected);
+            if(computed != expected || (!_source.checksum.empty() && _source.checksum != expected)) {
+                THROW(USER_CHKSUM_MISMATCH,
+                      fmt::format("checksum of replica [{}] of [{}] is [{}], source is [{}] with catalog checksum [{}]"
+                                  , _destination.replica_number
+                                  , _logical_path
+                                  , computed
+                                  , expected
+                                  , _source.checksum));
+            }
+
+            verify_source_unchanged();
+
+            keyValPair_t reg_param{};
+            addKeyVal(&reg_param, REPL_STATUS_KW, std::to_string(GOOD_REPLICA).c_str());
+            addKeyVal(&reg_param, DATA_SIZE_KW,   std::to_string(_source.size).c_str());
+            addKeyVal(&reg_param, CHKSUM_KW,      computed.c_str());
+            addKeyVal(&reg_param, DATA_MODIFY_KW, fmt::format("{:011}", std::time(nullptr)).c_str());
+
+            modify_replica(_comm, _logical_path, _destination, reg_param);
+        }
+        catch(const irods::exception&) {
+            try {
+                set_replica_status(_comm, _logical_path, _destination, STALE_REPLICA);
+            }
+            catch(const irods::exception& e) {
+                rodsLog(LOG_ERROR, "%s", e.client_display_what());
+            }
+
+            throw;
+        }
+
+        return result;
+
+    } // delta_sync_replica
+
+} // namespace irods
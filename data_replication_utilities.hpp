@@ -0,0 +1,103 @@
+#ifndef IRODS_DATA_REPLICATION_UTILITIES_HPP
+#define IRODS_DATA_REPLICATION_UTILITIES_HPP
+
+#include <irods/rodsType.h>
+#include <irods/rcConnect.h>
+
+#include <cstdint>
+#include <string>
+#include <vector>
+
+namespace irods {
+
+    // one of a fixed number of lock files shared by every agent on the host, the lock
+    // is held until the slot is destroyed or the agent exits
+    class replication_slot {
+    public:
+        replication_slot() = default;
+        explicit replication_slot(int _fd);
+        ~replication_slot();
+
+        replication_slot(replication_slot&& _other) noexcept;
+        replication_slot& operator=(replication_slot&& _other) noexcept;
+
+        replication_slot(const replication_slot&) = delete;
+        replication_slot& operator=(const replication_slot&) = delete;
+
+    private:
+        int fd_{-1};
+
+    }; // class replication_slot
+
+    // blocks until one of the slots for the resource within the directory is free
+    auto acquire_replication_slot(
+          const std::string& _directory
+        , const std::string& _resource
+        , uint32_t           _maximum) -> replication_slot;
+
+    // blocks until the host wide token bucket for the resource admits the given number
+    // of bytes.  the bucket holds at most one second of tokens and is kept within a
+    // lock file so that its rate is shared by every agent on the host
+    void acquire_host_bandwidth(
+          const std::string& _directory
+        , const std::string& _resource
+        , double             _bytes_per_second
+        , rodsLong_t         _bytes);
+
+    // the catalog attributes of one replica of a data object
+    struct replica_info {
+        rodsLong_t  data_id{};
+        int         replica_number{};
+        std::string physical_path;
+        std::string hierarchy;
+        rodsLong_t  size{};
+        std::string checksum;
+        std::string modify_time;
+    };
+
+    struct delta_sync_options {
+        rodsLong_t  block_size{4 * 1024 * 1024};
+
+        // the rule engine instance accepting policy invocations on the server holding
+        // each replica, through which the block digests are computed
+        std::string policy_instance{"irods_rule_engine_plugin-cpp_default_policy-instance"};
+
+        // if the digests cannot be computed next to a replica they are computed by
+        // reading it through this agent, otherwise the sync fails
+        bool        local_fallback{};
+    };
+
+    struct delta_sync_result {
+        rodsLong_t bytes_compared{};
+        rodsLong_t bytes_written{};
+
+        // the number of replicas whose digests were computed by reading them through
+        // this agent rather than on the server holding them
+        int        replicas_read_locally{};
+    };
+
+    // reads a replica in fixed size blocks and returns the digest of each block, run on
+    // the server holding the replica so that its bytes need not cross the network
+    auto compute_block_digests(
+          rsComm_t&           _comm
+        , const std::string&  _logical_path
+        , const replica_info& _replica
+        , rodsLong_t          _block_size) -> std::vector<std::string>;
+
+    // brings a stale replica up to date with a good replica of the same data object.  the
+    // block digests of each replica are computed on the server holding it and only the
+    // blocks which differ are read from the source and written.  the replica is
+    // intermediate while it is written, and is marked good with the size of the source
+    // once its checksum matches a checksum of the source computed after the copy and
+    // the source is still good and unmodified, otherwise it is left stale.
+    // throws on failure
+    auto delta_sync_replica(
+          rsComm_t&                 _comm
+        , const std::string&        _logical_path
+        , const replica_info&       _source
+        , const replica_info&       _destination
+        , const delta_sync_options& _options) -> delta_sync_result;
+
+} // namespace irods
+
+#endif // IRODS_DATA_REPLICATION_UTILITIES_HPP
@@ -2,10 +2,22 @@
 #include <irods/policy_composition_framework_policy_engine.hpp>
 #include <irods/policy_composition_framework_parameter_capture.hpp>
 
+#include <irods/filesystem.hpp>
 #include <irods/rsModAVUMetadata.hpp>
-#include <irods/rsOpenCollection.hpp>
-#include <irods/rsReadCollection.hpp>
-#include <irods/rsCloseCollection.hpp>
+#include <irods/thread_pool.hpp>
+
+#include <algorithm>
+#include <atomic>
+#include <cstdio>
+#include <map>
+#include <set>
+
+#include "access_time_utilities.hpp"
+#include "catalog_batch.hpp"
+#include "lru_cache.hpp"
+#include "owner_cache.hpp"
+#include "plugin_configuration.hpp"
+#include "throttle.hpp"
 
 namespace {
 
@@ -15,13 +27,150 @@ namespace {
     using     json = nlohmann::json;
     // clang-format on
 
-    auto update_access_time_for_data_object(
+    const std::string default_write_behind_spool{"/var/lib/irods/access_time_write_behind.spool"};
+
+    // the spool is appended to by the service account on behalf of any user, so it is
+    // only named within the plugin_specific_configuration and never by an invocation
+    auto get_write_behind_spool(const pe::context& _ctx) -> std::string
+    {
+        static const auto spool = pc::get(
+                                      pe::read_plugin_specific_configuration(_ctx.instance_name)
+                                    , "write_behind_spool"
+                                    , default_write_behind_spool);
+        return spool;
+    } // get_write_behind_spool
+
+    auto write_behind_enabled(const pe::context& _ctx) -> bool
+    {
+        return pc::get(_ctx.configuration, "write_behind", std::string{}) == "true";
+    } // write_behind_enabled
+
+    // true when invoked by a dry run of the query processor, no access time is recorded
+    auto dry_run_enabled(const pe::context& _ctx) -> bool
+    {
+        return pc::get(_ctx.parameters, "dry_run", std::string{}) == "true";
+    } // dry_run_enabled
+
+    // the buffer is static so that it is shared by every invocation within the agent,
+    // and its destructor writes any remaining entries to the spool as the agent exits
+    auto get_write_behind_buffer() -> irods::access_time_write_behind&
+    {
+        static irods::access_time_write_behind buffer{};
+        return buffer;
+    } // get_write_behind_buffer
+
+    // the caches are sized once for the lifetime of the agent, so their settings are only
+    // read from the plugin_specific_configuration rather than from the first invocation
+    auto get_cache_configuration(const pe::context& _ctx) -> const json&
+    {
+        static const auto configuration = pe::read_plugin_specific_configuration(_ctx.instance_name);
+        return configuration;
+    } // get_cache_configuration
+
+    // the most recent access time known to have been stored for an attribute and object,
+    // which is never later than the value within the catalog
+    auto get_stamp_cache(const pe::context& _ctx) -> pe::lru_cache<std::string, std::time_t>&
+    {
+        static pe::lru_cache<std::string, std::time_t> cache{
+            pc::get(get_cache_configuration(_ctx), "cache_size", uint32_t{100000})};
+        return cache;
+    } // get_stamp_cache
+
+    auto get_stored_access_time(
           rsComm_t*          _comm
-        , const std::string& _user_name
         , const std::string& _logical_path
-        , const std::string& _attribute)
+        , const std::string& _attribute) -> std::time_t
+    {
+        namespace fs = irods::experimental::filesystem;
+
+        fs::path p{_logical_path};
+
+        const auto query_str = fmt::format(
+                               "SELECT META_DATA_ATTR_VALUE WHERE COLL_NAME = '{}' AND DATA_NAME = '{}'"
+                               " AND META_DATA_ATTR_NAME = '{}'"
+                               , p.parent_path().string()
+                               , p.object_name().string()
+                               , _attribute);
+
+        irods::query<rsComm_t> q{_comm, query_str};
+        if(0 == q.size()) {
+            return 0;
+        }
+
+        try {
+            return std::stoll(q.front()[0]);
+        }
+        catch(const std::exception&) {
+            return 0;
+        }
+
+    } // get_stored_access_time
+
+    // true if the stored access time is within granularity_seconds of now, in which
+    // case the update is skipped as with the relatime mount option
+    auto access_time_is_recent(
+          const pe::context& _ctx
+        , rsComm_t*          _comm
+        , const std::string& _logical_path
+        , const std::string& _attribute
+        , std::time_t        _now) -> bool
+    {
+        const auto granularity = pc::get(_ctx.configuration, "granularity_seconds", uint32_t{0});
+        if(0 == granularity) {
+            return false;
+        }
+
+        auto& cache = get_stamp_cache(_ctx);
+        const auto key = _attribute + ":" + _logical_path;
+
+        if(const auto cached = cache.get(key); cached && _now - *cached < granularity) {
+            return true;
+        }
+
+        // only the cache is consulted for a name which cannot be queried
+        if(!pe::name_can_be_queried(_logical_path)) {
+            return false;
+        }
+
+        const auto stored = get_stored_access_time(_comm, _logical_path, _attribute);
+        if(_now - stored < granularity) {
+            cache.put(key, stored);
+            return true;
+        }
+
+        return false;
+
+    } // access_time_is_recent
+
+    // stamps a single data object, _comm is expected to act as the owner of the object
+    auto stamp_data_object(
+          const pe::context& _ctx
+        , rsComm_t&          _comm
+        , const std::string& _logical_path
+        , const std::string& _attribute) -> int
     {
-        auto ts = std::to_string(std::time(nullptr));
+        const auto now = std::time(nullptr);
+
+        if(access_time_is_recent(_ctx, &_comm, _logical_path, _attribute, now) || dry_run_enabled(_ctx)) {
+            return 0;
+        }
+
+        if(write_behind_enabled(_ctx)) {
+            get_write_behind_buffer().record(
+                  get_write_behind_spool(_ctx)
+                , _attribute
+                , _logical_path
+                , now
+                , pc::get(_ctx.configuration, "write_behind_entries", uint32_t{1000})
+                , pc::get(_ctx.configuration, "write_behind_seconds", uint32_t{30}));
+
+            // the time is not cached until the flush has stored it within the catalog
+            return 0;
+        }
+
+        pe::apply_throttle(_ctx.policy_name, _ctx.configuration, {});
+
+        auto ts = std::to_string(now);
         modAVUMetadataInp_t avuOp{
             "set",
             "-d",
@@ -30,85 +179,310 @@ namespace {
             const_cast<char*>(ts.c_str()),
             ""};
 
+        const auto ret = rsModAVUMetadata(&_comm, &avuOp);
+        if(ret >= 0 && pc::get(_ctx.configuration, "granularity_seconds", uint32_t{0}) > 0) {
+            get_stamp_cache(_ctx).put(_attribute + ":" + _logical_path, now);
+        }
+
+        return ret;
+
+    } // stamp_data_object
+
+    auto update_access_time_for_data_object(
+          const pe::context& _ctx
+        , rsComm_t*          _comm
+        , const std::string& _user_name
+        , const std::string& _logical_path
+        , const std::string& _attribute)
+    {
         auto mod_fcn = [&](auto& comm) {
-            return rsModAVUMetadata(&comm, &avuOp);};
+            return stamp_data_object(_ctx, comm, _logical_path, _attribute);};
 
         return pc::exec_as_user(*_comm, _user_name, mod_fcn);
 
     } // update_access_time_for_data_object
 
+    // escapes the LIKE wildcards within a literal matched by a wildcard operation
+    auto escape_like(const std::string& _literal) -> std::string
+    {
+        std::string escaped{};
+        for(const auto c : _literal) {
+            if('%' == c || '_' == c || '\\' == c) {
+                escaped += '\\';
+            }
+
+            escaped += c;
+        }
+
+        return escaped;
+    } // escape_like
+
+    // updates every data object directly within a collection with a catalog operation for
+    // each distinct access time rather than for each object.  the new time is added with
+    // addw before each previous time is removed with a targeted rmw, so an interruption
+    // leaves an object with an additional access time rather than none, which a later
+    // set replaces.  the wildcard operations match the collection name with LIKE, so names
+    // containing a wildcard character, or which cannot be queried, are not eligible
+    auto bulk_stamp_collection(
+          const pe::context&              _ctx
+        , rsComm_t&                       _comm
+        , const std::string&              _collection_name
+        , const std::vector<std::string>& _data_names
+        , const std::string&              _attribute) -> int
+    {
+        if(std::string::npos != _collection_name.find_first_of("%_") || !pe::name_can_be_queried(_collection_name)) {
+            return SYS_INVALID_INPUT_PARAM;
+        }
+
+        const auto now         = std::time(nullptr);
+        const auto granularity = pc::get(_ctx.configuration, "granularity_seconds", uint32_t{0});
+
+        // the latest access time stored for each object, and every distinct stored time
+        std::map<std::string, std::time_t> latest{};
+        std::set<std::string> previous{};
+
+        irods::query<rsComm_t> qobj{&_comm, fmt::format(
+                                                "SELECT DATA_NAME, META_DATA_ATTR_VALUE WHERE COLL_NAME = '{}' AND META_DATA_ATTR_NAME = '{}'"
+                                              , _collection_name
+                                              , _attribute)};
+        for(const auto& row : qobj) {
+            previous.insert(row[1]);
+
+            try {
+                auto& t = latest[row[0]];
+                t = std::max<std::time_t>(t, std::stoll(row[1]));
+            }
+            catch(const std::exception&) {
+            }
+        }
+
+        // as with a single object, the update is skipped while every object was recently stamped
+        if(granularity > 0) {
+            const auto all_recent = std::all_of(_data_names.begin(), _data_names.end(), [&](const auto& d) {
+                const auto itr = latest.find(d);
+                return itr != latest.end() && now - itr->second < granularity; });
+
+            if(all_recent) {
+                for(const auto& [d, t] : latest) {
+                    get_stamp_cache(_ctx).put(_attribute + ":" + _collection_name + "/" + d, t);
+                }
+
+                return 0;
+            }
+        }
+
+        auto ts = std::to_string(now);
+
+        // addw fails for an object already holding the new time, each object is then set in turn
+        if(previous.count(ts) > 0) {
+            return CATALOG_ALREADY_HAS_ITEM_BY_THAT_NAME;
+        }
+
+        if(dry_run_enabled(_ctx)) {
+            return 0;
+        }
+
+        pe::apply_throttle(_ctx.policy_name, _ctx.configuration, {});
+
+        auto pattern   = _collection_name + "/%";
+        auto attribute = escape_like(_attribute);
+
+        modAVUMetadataInp_t add_op{
+            "addw",
+            "-d",
+            const_cast<char*>(pattern.c_str()),
+            const_cast<char*>(_attribute.c_str()),
+            const_cast<char*>(ts.c_str()),
+            ""};
+
+        if(const auto ec = rsModAVUMetadata(&_comm, &add_op); ec < 0) {
+            return ec;
+        }
+
+        for(const auto& p : previous) {
+            auto value = escape_like(p);
+
+            modAVUMetadataInp_t rm_op{
+                "rmw",
+                "-d",
+                const_cast<char*>(pattern.c_str()),
+                const_cast<char*>(attribute.c_str()),
+                const_cast<char*>(value.c_str()),
+                ""};
+
+            if(const auto ec = rsModAVUMetadata(&_comm, &rm_op); ec < 0 && CAT_SUCCESS_BUT_WITH_NO_INFO != ec && CAT_NO_ROWS_FOUND != ec) {
+                return ec;
+            }
+        }
+
+        if(granularity > 0) {
+            for(const auto& d : _data_names) {
+                get_stamp_cache(_ctx).put(_attribute + ":" + _collection_name + "/" + d, now);
+            }
+        }
+
+        return 0;
+
+    } // bulk_stamp_collection
+
+    // stamps every data object within a collection and its sub-collections.  the objects
+    // are listed by a single paged query rather than walking the tree, unless the name
+    // cannot be named within a query, and are stamped by a pool of number_of_threads
+    // workers.  returns the number of objects which failed
     auto apply_access_time_to_collection(
-          rsComm_t*          _comm
+          const pe::context& _ctx
+        , rsComm_t*          _comm
         , const std::string& _user_name
-        , int                _handle
+        , const std::string& _logical_path
         , const std::string& _attribute) -> int
     {
-        collEnt_t* coll_ent{nullptr};
-        auto err = rsReadCollection(_comm, &_handle, &coll_ent);
-        while(err >= 0) {
-            if(DATA_OBJ_T == coll_ent->objType) {
-                using fsp = irods::experimental::filesystem::path;
-                auto  lp  = fsp{coll_ent->collName} / fsp{coll_ent->dataName};
-                err = update_access_time_for_data_object(_comm, _user_name, lp.string(), _attribute);
-                if(err < 0) {
-                    rodsLog(LOG_NOTICE,
-                            "irods_policy_access_time :: failed to update access time for object [%s]",
-                            lp.string().c_str());
+        using fsp = irods::experimental::filesystem::path;
+
+        // collections holding at least this many data objects are updated in bulk, unless
+        // each object is instead recorded within the write behind buffer
+        const auto bulk_threshold    = write_behind_enabled(_ctx)
+                                       ? uint32_t{0}
+                                       : pc::get(_ctx.configuration, "bulk_update_threshold", uint32_t{100});
+        const auto number_of_threads = std::max(pc::get(_ctx.configuration, "number_of_threads", uint32_t{4}), 1u);
+
+        std::map<std::string, std::vector<std::string>> objects{};
+
+        if(pe::name_can_be_queried(_logical_path)) {
+            // wildcards within the name would otherwise match other collections
+            const auto query_str = fmt::format(
+                                   "SELECT COLL_NAME, DATA_NAME WHERE COLL_NAME = '{}' || like '{}/%'"
+                                   , _logical_path
+                                   , escape_like(_logical_path));
+
+            irods::query<rsComm_t> qobj{_comm, query_str};
+            for(const auto& row : qobj) {
+                objects[row[0]].push_back(row[1]);
+            }
+        }
+        else {
+            namespace fsvr = irods::experimental::filesystem::server;
+
+            for(const auto& e : fsvr::recursive_collection_iterator{*_comm, fsp{_logical_path}}) {
+                if(e.is_data_object()) {
+                    objects[e.path().parent_path().string()].push_back(e.path().object_name().string());
+                }
+            }
+        }
+
+        auto mod_fcn = [&](auto& comm) -> int {
+            std::vector<std::string> logical_paths{};
+
+            for(const auto& [collection_name, data_names] : objects) {
+                if(bulk_threshold > 0 && data_names.size() >= bulk_threshold) {
+                    if(bulk_stamp_collection(_ctx, comm, collection_name, data_names, _attribute) >= 0) {
+                        continue;
+                    }
+
+                    rodsLog(LOG_DEBUG,
+                            "irods_policy_access_time :: bulk update not applied for collection [%s]",
+                            collection_name.c_str());
+                }
+
+                for(const auto& d : data_names) {
+                    logical_paths.push_back((fsp{collection_name} / fsp{d}).string());
                 }
             }
-            else if(COLL_OBJ_T == coll_ent->objType) {
-                collInp_t coll_inp;
-                memset(&coll_inp, 0, sizeof(coll_inp));
-                rstrcpy(
-                    coll_inp.collName,
-                    coll_ent->collName,
-                    MAX_NAME_LEN);
-                auto handle = rsOpenCollection(_comm, &coll_inp);
-                err = apply_access_time_to_collection(_comm, _user_name, handle, _attribute);
-                rsCloseCollection(_comm, &handle);
+
+            if(logical_paths.empty()) {
+                return 0;
+            }
+
+            std::atomic<uint32_t> failed{};
+
+            irods::thread_pool pool{std::min<uint32_t>(number_of_threads, logical_paths.size())};
+            for(const auto& lp : logical_paths) {
+                irods::thread_pool::post(pool, [&] {
+                    if(stamp_data_object(_ctx, comm, lp, _attribute) < 0) {
+                        ++failed;
+                        rodsLog(LOG_NOTICE,
+                                "irods_policy_access_time :: failed to update access time for object [%s]",
+                                lp.c_str());
+                    }
+                });
             }
 
-            err = rsReadCollection(_comm, &_handle, &coll_ent);
+            pool.join();
 
-        } // while
+            return static_cast<int>(failed.load());
+        };
 
-        return err;
+        return pc::exec_as_user(*_comm, _user_name, mod_fcn);
 
     } // apply_access_time_to_collection
 
-    auto get_user_name_for_data_object(
-        rsComm_t*          comm
-      , const std::string& logical_path)
+
+
+
+    // applies the write behind spool to the catalog, keeping the latest access time
+    // recorded for each object such that many accesses cost a single catalog update
+    auto flush_write_behind_spool(const pe::context& _ctx) -> irods::error
     {
-        namespace fs = irods::experimental::filesystem;
+        auto comm = _ctx.rei->rsComm;
 
-        fs::path p{logical_path};
+        if(comm->clientUser.authInfo.authFlag < LOCAL_PRIV_USER_AUTH) {
+            return ERROR(
+                       CAT_INSUFFICIENT_PRIVILEGE_LEVEL,
+                       "irods_policy_access_time :: flushing the write behind spool requires rodsadmin");
+        }
 
-        auto data_name = p.object_name().string();
-        auto coll_name = p.parent_path().string();
+        // entries written by this agent are included
+        get_write_behind_buffer().write();
 
-        auto str = std::string{"SELECT USER_NAME WHERE COLL_NAME = '"}+coll_name+"' AND DATA_NAME = '"+data_name+"'";
-        irods::query<rsComm_t> q{comm, str};
-        return q.front()[0];
+        const auto spool = get_write_behind_spool(_ctx);
 
-    } // get_user_name_for_data_object
+        auto [entries, files] = irods::take_access_time_spool(spool);
 
+        uint32_t applied{}, failed{};
+        for(const auto& [key, time] : entries) {
+            pe::apply_throttle(_ctx.policy_name, _ctx.configuration, {});
 
+            auto ts = std::to_string(time);
+            modAVUMetadataInp_t avuOp{
+                "set",
+                "-d",
+                const_cast<char*>(key.second.c_str()),
+                const_cast<char*>(key.first.c_str()),
+                const_cast<char*>(ts.c_str()),
+                ""};
 
-    auto get_user_name_for_collection(
-        rsComm_t*          comm
-      , const std::string& logical_path)
-    {
-        auto str = std::string{"SELECT USER_NAME WHERE COLL_NAME = '"}+logical_path+"'";
-        irods::query<rsComm_t> q{comm, str};
-        return q.front()[0];
+            // the object may have been removed since it was accessed
+            if(rsModAVUMetadata(comm, &avuOp) < 0) {
+                ++failed;
+            }
+            else {
+                ++applied;
+
+                if(pc::get(_ctx.configuration, "granularity_seconds", uint32_t{0}) > 0) {
+                    get_stamp_cache(_ctx).put(key.first + ":" + key.second, time);
+                }
+            }
+        }
+
+        for(const auto& f : files) {
+            std::remove(f.c_str());
+        }
 
-    } // get_user_name_for_collection
+        pe::client_message({{"0.message", fmt::format(
+                                              "{} flushed [{}] access times, [{}] failed"
+                                            , _ctx.policy_name
+                                            , applied
+                                            , failed)}});
 
+        return SUCCESS();
 
+    } // flush_write_behind_spool
 
     auto access_time_policy(const pe::context& ctx, pe::arg_type out)
     {
+        if(pc::get(ctx.parameters, "mode", std::string{}) == "flush") {
+            return dry_run_enabled(ctx) ? SUCCESS() : flush_write_behind_spool(ctx);
+        }
+
         auto [user_name, logical_path, source_resource, destination_resource] =
             capture_parameters(ctx.parameters, tag_first_resc);
 
@@ -120,11 +494,38 @@ namespace {
         auto attribute            = pc::get(ctx.configuration, "attribute",  std::string{"irods::access_time"});
         auto cond_input           = pc::get(ctx.parameters,    "cond_input", json{});
         auto collection_operation = !cond_input.empty() && !cond_input[COLLECTION_KW].empty();
+        auto event                = pc::get(ctx.parameters,    "event",      std::string{});
+
+        // a renamed or removed path may next name an object with another owner, and the
+        // source of a rename or a removed object no longer exists to be annotated
+        auto path_changed = "RENAME" == event || "UNLINK" == event;
+        if(path_changed) {
+            pe::invalidate_owner(get_cache_configuration(ctx), logical_path);
+            get_stamp_cache(ctx).erase(attribute + ":" + logical_path);
+        }
+
+        if("UNLINK" == event) {
+            return SUCCESS();
+        }
 
         if(!collection_operation) {
-            user_name = get_user_name_for_data_object(comm, logical_path);
+            // a buffered update is applied by the flush as an administrator, the owner
+            // lookup then only serves to skip the source of a rename
+            if(!write_behind_enabled(ctx) || path_changed) {
+                user_name = pe::get_data_object_owner(comm, get_cache_configuration(ctx), logical_path);
+                if(user_name.empty()) {
+                    if(path_changed) {
+                        return SUCCESS();
+                    }
+
+                    return ERROR(
+                               CAT_NO_ROWS_FOUND,
+                               boost::format("failed to find owner of object [%s]")
+                               % logical_path);
+                }
+            }
 
-            int status =  update_access_time_for_data_object(comm, user_name, logical_path, attribute);
+            int status =  update_access_time_for_data_object(ctx, comm, user_name, logical_path, attribute);
             if(status < 0) {
                 return ERROR(
                            status,
@@ -133,30 +534,33 @@ namespace {
             }
         }
         else {
-            user_name = get_user_name_for_collection(comm, logical_path);
-
-            // register a collection
-            collInp_t coll_inp;
-            memset(&coll_inp, 0, sizeof(coll_inp));
-            rstrcpy(
-                  coll_inp.collName
-                , logical_path.c_str()
-                , MAX_NAME_LEN);
-            auto handle = rsOpenCollection(comm, &coll_inp);
-            if(handle < 0) {
+            user_name = pe::get_collection_owner(comm, ctx.configuration, logical_path);
+            if(user_name.empty()) {
+                if(path_changed) {
+                    return SUCCESS();
+                }
+
                 return ERROR(
-                           handle,
-                           boost::format("failed to open collection [%s]") %
-                           logical_path);
+                           CAT_NO_ROWS_FOUND,
+                           boost::format("failed to find owner of collection [%s]")
+                           % logical_path);
             }
 
-            auto status = apply_access_time_to_collection(comm, user_name, handle, attribute);
-            if(status < 0) {
+            auto failed = apply_access_time_to_collection(ctx, comm, user_name, logical_path, attribute);
+            if(failed < 0) {
                 return ERROR(
-                           status,
+                           failed,
                            boost::format("failed to update access time for collection [%s]")
                                % logical_path);
             }
+
+            if(failed > 0) {
+                return ERROR(
+                           SYS_INVALID_OPR_TYPE,
+                           boost::format("failed to update access time for [%d] objects in collection [%s]")
+                               % failed
+                               % logical_path);
+            }
         }
 
         return SUCCESS();
@@ -7,8 +7,22 @@
 
 #include <irods/physPath.hpp>
 #include <irods/apiNumber.h>
+#include <irods/thread_pool.hpp>
 
+#include <boost/algorithm/string/join.hpp>
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <map>
+#include <optional>
+#include <set>
+
+#include "catalog_batch.hpp"
+#include "data_replication_utilities.hpp"
 #include "parameter_substitution.hpp"
+#include "plugin_configuration.hpp"
+#include "throttle.hpp"
 
 namespace {
 
@@ -19,6 +33,8 @@ namespace {
     using     json = nlohmann::json;
     // clang-format on
 
+    const std::string default_slot_directory{"/var/lib/irods/replication_slots"};
+
     auto destination_replica_exists(
         rsComm_t* comm
       , const std::string& resource
@@ -44,41 +60,876 @@ namespace {
 
     } // destination_replica_exists
 
-    auto replicate_object_to_resource(
+    auto get_data_size(
+        rsComm_t* comm
+      , const std::string& logical_path) -> rodsLong_t
+    {
+        namespace fs = irods::experimental::filesystem;
+
+        fs::path path{logical_path};
+        const auto coll_name = path.parent_path();
+        const auto data_name = path.object_name();
+
+        // all good replicas share the same size
+        auto qstr{fmt::format(
+                  "SELECT DATA_SIZE WHERE COLL_NAME = '{}' AND DATA_NAME = '{}' AND DATA_REPL_STATUS = '1'"
+                  , coll_name.string()
+                  , data_name.string())};
+
+        irods::query qobj{comm, qstr};
+
+        return qobj.size() > 0 ? std::stoll(qobj.front()[0]) : 0;
+
+    } // get_data_size
+
+    // a replication of a data object from a source to a destination resource
+    struct replication {
+        std::string source;
+        std::string destination;
+    };
+
+    auto verify_checksum_enabled(const pe::context& _ctx) -> bool
+    {
+        return pc::get(_ctx.configuration, "verify_checksum", std::string{}) == "true";
+    } // verify_checksum_enabled
+
+    // compares the catalog checksums of the good replicas on the source and destination,
+    // both of which must be present and equal
+    auto compare_replica_checksums(
           rsComm_t*          _comm
-        , const std::string& _user_name
         , const std::string& _logical_path
-        , const std::string& _source_resource
-        , const std::string& _destination_resource)
+        , const replication& _replication) -> int
+    {
+        namespace fs = irods::experimental::filesystem;
+
+        fs::path path{_logical_path};
+
+        auto qstr{fmt::format(
+                  "SELECT DATA_CHECKSUM, RESC_ID WHERE COLL_NAME = '{}' AND DATA_NAME = '{}' AND DATA_REPL_STATUS = '1' AND RESC_ID IN ({}, {})"
+                  , path.parent_path().string()
+                  , path.object_name().string()
+                  , pe::compute_leaf_bundle(_replication.source)
+                  , pe::compute_leaf_bundle(_replication.destination))};
+
+        std::vector<std::string> checksums{};
+
+        irods::query<rsComm_t> qobj{_comm, qstr};
+        for(const auto& row : qobj) {
+            checksums.push_back(row[0]);
+        }
+
+        const auto valid = checksums.size() >= 2 &&
+                           std::all_of(checksums.begin(), checksums.end(), [&checksums](const auto& c) {
+                               return !c.empty() && c == checksums.front();
+                           });
+
+        if(!valid) {
+            rodsLog(LOG_ERROR,
+                    "irods_policy_data_replication - checksums of [%s] on [%s] and [%s] do not match",
+                    _logical_path.c_str(),
+                    _replication.source.c_str(),
+                    _replication.destination.c_str());
+            return USER_CHKSUM_MISMATCH;
+        }
+
+        return 0;
+
+    } // compare_replica_checksums
+
+    // the first replica of an object on a resource with the given replica status
+    auto get_replica_info(
+          rsComm_t*          _comm
+        , const std::string& _logical_path
+        , const std::string& _resource
+        , const std::string& _replica_status) -> std::optional<irods::replica_info>
+    {
+        namespace fs = irods::experimental::filesystem;
+
+        fs::path path{_logical_path};
+
+        auto qstr{fmt::format(
+                  "SELECT DATA_ID, DATA_REPL_NUM, DATA_PATH, DATA_RESC_HIER, DATA_SIZE, DATA_CHECKSUM, DATA_MODIFY_TIME WHERE COLL_NAME = '{}' AND DATA_NAME = '{}' AND DATA_REPL_STATUS = '{}' AND RESC_ID IN ({})"
+                  , path.parent_path().string()
+                  , path.object_name().string()
+                  , _replica_status
+                  , pe::compute_leaf_bundle(_resource))};
+
+        irods::query<rsComm_t> qobj{_comm, qstr, 1};
+        if(qobj.size() == 0) {
+            return std::nullopt;
+        }
+
+        const auto row = qobj.front();
+
+        return irods::replica_info{std::stoll(row[0]), std::stoi(row[1]), row[2], row[3], std::stoll(row[4]), row[5], row[6]};
+
+    } // get_replica_info
+
+    auto get_replica_info_by_number(
+          rsComm_t*          _comm
+        , const std::string& _logical_path
+        , int                _replica_number) -> std::optional<irods::replica_info>
+    {
+        namespace fs = irods::experimental::filesystem;
+
+        fs::path path{_logical_path};
+
+        auto qstr{fmt::format(
+                  "SELECT DATA_ID, DATA_REPL_NUM, DATA_PATH, DATA_RESC_HIER, DATA_SIZE, DATA_CHECKSUM, DATA_MODIFY_TIME WHERE COLL_NAME = '{}' AND DATA_NAME = '{}' AND DATA_REPL_NUM = '{}'"
+                  , path.parent_path().string()
+                  , path.object_name().string()
+                  , _replica_number)};
+
+        irods::query<rsComm_t> qobj{_comm, qstr, 1};
+        if(qobj.size() == 0) {
+            return std::nullopt;
+        }
+
+        const auto row = qobj.front();
+
+        return irods::replica_info{std::stoll(row[0]), std::stoi(row[1]), row[2], row[3], std::stoll(row[4]), row[5], row[6]};
+
+    } // get_replica_info_by_number
+
+    // invoked by a delta sync on the server holding a replica, returns the digests of
+    // its blocks so that only the digests cross the network
+    auto report_block_digests(const pe::context& _ctx, pe::arg_type _out) -> irods::error
+    {
+        auto comm = _ctx.rei->rsComm;
+
+        if(comm->clientUser.authInfo.authFlag < LOCAL_PRIV_USER_AUTH) {
+            return ERROR(
+                       CAT_INSUFFICIENT_PRIVILEGE_LEVEL,
+                       boost::format("%s - block digests require administrative privileges")
+                       % _ctx.policy_name);
+        }
+
+        const auto logical_path   = pc::get(_ctx.parameters, "logical_path", std::string{});
+        const auto request        = _ctx.parameters.at("block_digests");
+        const auto replica_number = request.value("replica_number", -1);
+        const auto block_size     = request.value("block_size", rodsLong_t{4 * 1024 * 1024});
+        const auto token          = request.value("token", std::string{});
+
+        const auto replica = get_replica_info_by_number(comm, logical_path, replica_number);
+        if(!replica) {
+            return ERROR(
+                       CAT_NO_ROWS_FOUND,
+                       boost::format("%s - replica [%d] of [%s] not found")
+                       % _ctx.policy_name
+                       % replica_number
+                       % logical_path);
+        }
+
+        try {
+            const auto digests = irods::compute_block_digests(*comm, logical_path, *replica, block_size);
+
+            // delimited by the token of the request so that the requesting agent can find
+            // the list within the output
+            pe::client_message({{"0.block_digests", "<" + token + ":" + boost::algorithm::join(digests, ",") + ">"}});
+
+            if(_out) {
+                *_out = json{{"block_digests", digests}}.dump();
+            }
+        }
+        catch(const irods::exception& e) {
+            return ERROR(e.code(), e.client_display_what());
+        }
+
+        return SUCCESS();
+
+    } // report_block_digests
+
+    // true when invoked by a dry run of the query processor, the replicas which would be
+    // created or updated are counted but not written
+    auto dry_run_enabled(const pe::context& _ctx) -> bool
+    {
+        return pc::get(_ctx.parameters, "dry_run", std::string{}) == "true";
+    } // dry_run_enabled
+
+    auto delta_sync_enabled(const pe::context& _ctx) -> bool
+    {
+        return pc::get(_ctx.configuration, "delta_sync", std::string{}) == "true";
+    } // delta_sync_enabled
+
+    // updates a stale replica on the destination in place from a good replica on the
+    // source, writing only the blocks which differ.  returns nullopt if there is no
+    // stale replica to update, leaving the object to be replicated in full
+    auto delta_sync_object(
+          const pe::context& _ctx
+        , rsComm_t&          _comm
+        , const std::string& _logical_path
+        , const replication& _replication) -> std::optional<int>
+    {
+        const auto destination = get_replica_info(&_comm, _logical_path, _replication.destination, "0");
+        if(!destination) {
+            return std::nullopt;
+        }
+
+        const auto source = get_replica_info(&_comm, _logical_path, _replication.source, "1");
+        if(!source) {
+            return std::nullopt;
+        }
+
+        irods::delta_sync_options options{};
+        options.block_size      = pc::get(_ctx.configuration, "delta_block_size",          options.block_size);
+        options.policy_instance = pc::get(_ctx.configuration, "delta_sync_policy_instance", options.policy_instance);
+        options.local_fallback  = pc::get(_ctx.configuration, "delta_sync_local_fallback",  std::string{}) == "true";
+
+        try {
+            const auto result = irods::delta_sync_replica(_comm, _logical_path, *source, *destination, options);
+
+            rodsLog(result.replicas_read_locally > 0 ? LOG_NOTICE : LOG_DEBUG,
+                    "irods_policy_data_replication - delta sync of [%s] to [%s] compared [%lld] bytes and wrote [%lld], [%d] replicas read through this agent",
+                    _logical_path.c_str(),
+                    _replication.destination.c_str(),
+                    result.bytes_compared,
+                    result.bytes_written,
+                    result.replicas_read_locally);
+
+            return 0;
+        }
+        catch(const irods::exception& e) {
+            rodsLog(LOG_ERROR, "%s", e.client_display_what());
+            return e.code();
+        }
+
+    } // delta_sync_object
+
+    // true if a host wide bandwidth limit is configured for any of the destinations
+    auto destination_limits_require_size(
+          const json&                     _configuration
+        , const std::vector<std::string>& _resources) -> bool
     {
+        const auto limits = pc::get(_configuration, "destination_limits", json{});
+
+        return std::any_of(_resources.begin(), _resources.end(), [&limits](const auto& r) {
+            return limits.contains(r) && limits.at(r).contains("bytes_per_second");
+        });
+
+    } // destination_limits_require_size
+
+    // takes a slot for the destination and waits for its share of the bandwidth, both
+    // of which are shared by every agent on the host.  the slot is held until the
+    // returned object is destroyed
+    auto apply_destination_limits(
+          const pe::context& _ctx
+        , const std::string& _destination_resource
+        , rodsLong_t         _bytes) -> irods::replication_slot
+    {
+        const auto limits = pc::get(_ctx.configuration, "destination_limits", json{});
+        if(!limits.contains(_destination_resource)) {
+            return {};
+        }
+
+        const auto& limit     = limits.at(_destination_resource);
+        // lock files are created by the service account, so their directory is only
+        // read from the plugin_specific_configuration rather than from the client
+        const auto  directory = pc::get(
+                                    pe::read_plugin_specific_configuration(_ctx.instance_name)
+                                  , "slot_directory"
+                                  , default_slot_directory);
+
+        irods::replication_slot slot{};
 
-        if(destination_replica_exists(_comm, _destination_resource, _logical_path)) {
+        const auto maximum = limit.value("maximum_concurrent", uint32_t{0});
+        if(maximum > 0) {
+            slot = irods::acquire_replication_slot(directory, _destination_resource, maximum);
+        }
+
+        if(limit.contains("bytes_per_second")) {
+            irods::acquire_host_bandwidth(
+                directory
+              , _destination_resource
+              , limit.at("bytes_per_second").get<double>()
+              , _bytes);
+        }
+
+        return slot;
+
+    } // apply_destination_limits
+
+    auto replicate_object(
+          const pe::context&  _ctx
+        , rsComm_t&           _comm
+        , const std::string&  _logical_path
+        , const replication&  _replication
+        , bool                _admin
+        , rodsLong_t          _bytes) -> int
+    {
+        if(dry_run_enabled(_ctx)) {
+            rodsLog(LOG_DEBUG,
+                    "irods_policy_data_replication - dry run, [%s] would be replicated from [%s] to [%s]",
+                    _logical_path.c_str(),
+                    _replication.source.c_str(),
+                    _replication.destination.c_str());
             return 0;
         }
 
+        pe::apply_throttle(_ctx.policy_name, _ctx.configuration, {_replication.source, _replication.destination}, _bytes);
+
+        irods::replication_slot slot{};
+
+        try {
+            slot = apply_destination_limits(_ctx, _replication.destination, _bytes);
+        }
+        catch(const irods::exception& e) {
+            rodsLog(LOG_ERROR, "%s", e.client_display_what());
+            return e.code();
+        }
+
+        if(delta_sync_enabled(_ctx)) {
+            if(const auto ret = delta_sync_object(_ctx, _comm, _logical_path, _replication); ret) {
+                return *ret;
+            }
+        }
+
         dataObjInp_t data_obj_inp{};
         rstrcpy(data_obj_inp.objPath, _logical_path.c_str(), MAX_NAME_LEN);
         data_obj_inp.createMode = getDefFileMode();
-        addKeyVal(&data_obj_inp.condInput, RESC_NAME_KW,      _source_resource.c_str());
-        addKeyVal(&data_obj_inp.condInput, DEST_RESC_NAME_KW, _destination_resource.c_str());
+        addKeyVal(&data_obj_inp.condInput, RESC_NAME_KW,      _replication.source.c_str());
+        addKeyVal(&data_obj_inp.condInput, DEST_RESC_NAME_KW, _replication.destination.c_str());
 
-        if(_comm->clientUser.authInfo.authFlag >= LOCAL_PRIV_USER_AUTH) {
+        if(_admin) {
             addKeyVal(&data_obj_inp.condInput, ADMIN_KW, "true" );
         }
 
+        // the server checksums the replica as it is written and compares it with the
+        // checksum of the source, registering one for the source if it has none
+        const auto verify = verify_checksum_enabled(_ctx);
+        if(verify) {
+            addKeyVal(&data_obj_inp.condInput, VERIFY_CHKSUM_KW, "");
+        }
+
         transferStat_t* trans_stat{};
 
-        auto repl_fcn = [&](auto& comm){
-            auto ret = irods::server_api_call(DATA_OBJ_REPL_AN, _comm, &data_obj_inp, &trans_stat);
-            free(trans_stat);
-            return ret;};
+        auto ret = irods::server_api_call(DATA_OBJ_REPL_AN, &_comm, &data_obj_inp, &trans_stat);
+        free(trans_stat);
+        clearKeyVal(&data_obj_inp.condInput);
+
+        if(ret < 0 || !verify) {
+            return ret;
+        }
+
+        return compare_replica_checksums(&_comm, _logical_path, _replication);
+
+    } // replicate_object
+
+    // replicates an object for each source and destination which does not already hold
+    // a good replica.  up to maximum_concurrent_replications are issued at once, each
+    // as the invoking user.  returns the error code for each failed destination
+    auto replicate_object_to_resources(
+          const pe::context&              _ctx
+        , rsComm_t*                       _comm
+        , const std::string&              _user_name
+        , const std::string&              _logical_path
+        , const std::vector<replication>& _replications) -> std::map<std::string, int>
+    {
+        std::vector<replication> pending{};
+        std::vector<std::string> resources{};
+
+        for(const auto& r : _replications) {
+            if(!destination_replica_exists(_comm, r.destination, _logical_path)) {
+                pending.push_back(r);
+                resources.push_back(r.source);
+                resources.push_back(r.destination);
+            }
+        }
+
+        if(pending.empty()) {
+            return {};
+        }
+
+        const auto bytes = pe::throttle_requires_size(_ctx.configuration, resources) ||
+                           destination_limits_require_size(_ctx.configuration, resources)
+                           ? get_data_size(_comm, _logical_path)
+                           : rodsLong_t{0};
+
+        const auto admin = _comm->clientUser.authInfo.authFlag >= LOCAL_PRIV_USER_AUTH;
+
+        const auto maximum_concurrent = std::max(
+                                            pc::get(_ctx.configuration, "maximum_concurrent_replications", uint32_t{1}),
+                                            1u);
+
+        std::vector<int> results(pending.size(), 0);
+
+        auto repl_fcn = [&](auto& comm) {
+            if(maximum_concurrent == 1 || pending.size() == 1) {
+                for(std::size_t i = 0; i < pending.size(); ++i) {
+                    results[i] = replicate_object(_ctx, comm, _logical_path, pending[i], admin, bytes);
+                }
+
+                return 0;
+            }
+
+            irods::thread_pool pool{std::min<uint32_t>(maximum_concurrent, pending.size())};
+            for(std::size_t i = 0; i < pending.size(); ++i) {
+                irods::thread_pool::post(pool, [&, i] {
+                    results[i] = replicate_object(_ctx, comm, _logical_path, pending[i], admin, bytes);
+                });
+            }
+
+            pool.join();
+
+            return 0;
+        };
+
+        pc::exec_as_user(*_comm, _user_name, repl_fcn);
+
+        std::map<std::string, int> failures{};
+        for(std::size_t i = 0; i < pending.size(); ++i) {
+            if(results[i] < 0) {
+                failures[pending[i].destination] = results[i];
+            }
+        }
 
-        return pc::exec_as_user(*_comm, _user_name, repl_fcn);
+        return failures;
 
-    } // replicate_object_to_resource
+    } // replicate_object_to_resources
+
+    // replicates to the destinations in waves.  a star feeds every destination from the
+    // source resource in one wave, a chain feeds each destination from the previous one,
+    // and a tree feeds each wave from the source and every destination already holding
+    // a good replica, doubling the number of readers with each wave
+    auto replicate_object_with_topology(
+          const pe::context&              _ctx
+        , rsComm_t*                       _comm
+        , const std::string&              _user_name
+        , const std::string&              _logical_path
+        , const std::string&              _source_resource
+        , const std::vector<std::string>& _destination_resources) -> std::map<std::string, int>
+    {
+        const auto topology = pc::get(_ctx.configuration, "replication_topology", std::string{"star"});
+
+        if("star" == topology) {
+            std::vector<replication> replications{};
+            for(const auto& dest : _destination_resources) {
+                replications.push_back({_source_resource, dest});
+            }
+
+            return replicate_object_to_resources(_ctx, _comm, _user_name, _logical_path, replications);
+        }
+
+        if("chain" != topology && "tree" != topology) {
+            THROW(
+                SYS_INVALID_INPUT_PARAM,
+                boost::format("%s - unsupported replication_topology [%s]")
+                % _ctx.policy_name
+                % topology);
+        }
+
+        // resources holding a good replica, the most recent last
+        std::vector<std::string> sources{_source_resource};
+        std::map<std::string, int> failures{};
+
+        std::size_t next{};
+        while(next < _destination_resources.size()) {
+            const auto width = "chain" == topology ? std::size_t{1} : sources.size();
+
+            std::vector<replication> wave{};
+            for(std::size_t i = 0; i < width && next < _destination_resources.size(); ++i, ++next) {
+                wave.push_back({sources[sources.size() - 1 - i], _destination_resources[next]});
+            }
+
+            auto wave_failures = replicate_object_to_resources(_ctx, _comm, _user_name, _logical_path, wave);
+
+            for(const auto& r : wave) {
+                if(wave_failures.count(r.destination) > 0) {
+                    failures[r.destination] = wave_failures.at(r.destination);
+                    continue;
+                }
+
+                // only a replica confirmed as good within the catalog feeds later waves,
+                // a dry run writes no replica and assumes each would succeed
+                if(dry_run_enabled(_ctx) || destination_replica_exists(_comm, r.destination, _logical_path)) {
+                    sources.push_back(r.destination);
+                }
+                else {
+                    rodsLog(LOG_NOTICE,
+                            "irods_policy_data_replication - replica of [%s] on [%s] is not good, it will not be used as a source",
+                            _logical_path.c_str(),
+                            r.destination.c_str());
+                }
+            }
+        }
+
+        return failures;
+
+    } // replicate_object_with_topology
+
+    auto make_replication_error(
+          const std::string&                _logical_path
+        , const std::string&                _source_resource
+        , const std::map<std::string, int>& _failures) -> irods::error
+    {
+        std::string destinations{};
+        for(const auto& [dest, code] : _failures) {
+            destinations += fmt::format("{}[{}] ", dest, code);
+        }
+
+        return ERROR(
+                  _failures.begin()->second,
+                  boost::format("failed to replicate [%s] from [%s] to %s")
+                  % _logical_path
+                  % _source_resource
+                  % destinations);
+
+    } // make_replication_error
+
+    // the size of the good replica for each object which has one, and whether a good
+    // replica already exists on the destination.  objects are queried per collection
+    // with up to bulk_batch_size names within each query
+    struct bulk_object {
+        rodsLong_t size{};
+        bool       on_destination{};
+    };
+
+    auto resolve_bulk_objects(
+          rsComm_t*                       _comm
+        , const std::string&              _destination_resource
+        , const std::vector<std::string>& _logical_paths
+        , uint32_t                        _batch_size) -> std::map<std::string, bulk_object>
+    {
+        using fsp = irods::experimental::filesystem::path;
+
+        const auto leaf_bundle = pe::compute_leaf_bundle(_destination_resource);
+
+        std::map<std::string, bulk_object> objects{};
+
+        pe::for_each_name_batch(_logical_paths, _batch_size, [&](const auto& coll_name, const auto& in_list) {
+            // all good replicas share the same size
+            irods::query<rsComm_t> sizes{_comm, fmt::format(
+                                                    "SELECT DATA_NAME, DATA_SIZE WHERE COLL_NAME = '{}' AND DATA_NAME IN ({}) AND DATA_REPL_STATUS = '1'"
+                                                    , coll_name
+                                                    , in_list)};
+            for(const auto& row : sizes) {
+                objects[(fsp{coll_name} / fsp{row[0]}).string()].size = std::stoll(row[1]);
+            }
+
+            irods::query<rsComm_t> existing{_comm, fmt::format(
+                                                       "SELECT DATA_NAME WHERE COLL_NAME = '{}' AND DATA_NAME IN ({}) AND DATA_REPL_STATUS = '1' AND RESC_ID IN ({})"
+                                                       , coll_name
+                                                       , in_list
+                                                       , leaf_bundle)};
+            for(const auto& row : existing) {
+                objects[(fsp{coll_name} / fsp{row[0]}).string()].on_destination = true;
+            }
+        });
+
+        return objects;
+
+    } // resolve_bulk_objects
+
+    // replicates each of logical_paths which lacks a good replica on the destination
+    // across a pool of number_of_threads workers, reporting the throughput achieved
+    auto bulk_replication(
+          const pe::context& _ctx
+        , pe::arg_type       _out
+        , const std::string& _user_name
+        , const std::string& _source_resource
+        , const std::string& _destination_resource) -> irods::error
+    {
+        auto comm = _ctx.rei->rsComm;
+
+        if(_destination_resource.empty()) {
+            return ERROR(
+                       SYS_INVALID_INPUT_PARAM,
+                       boost::format("%s - bulk replication requires a destination_resource")
+                       % _ctx.policy_name);
+        }
+
+        const auto logical_paths     = _ctx.parameters.at("logical_paths").get<std::vector<std::string>>();
+        const auto batch_size        = std::max(pc::get(_ctx.configuration, "bulk_batch_size", uint32_t{100}), 1u);
+        const auto number_of_threads = std::max(pc::get(_ctx.configuration, "number_of_threads", uint32_t{4}), 1u);
+
+        const auto start   = std::chrono::steady_clock::now();
+        const auto objects = resolve_bulk_objects(comm, _destination_resource, logical_paths, batch_size);
+
+        std::vector<std::string> pending{};
+        uint32_t missing{}, existing{}, unqueryable{};
+
+        for(const auto& lp : logical_paths) {
+            if(!pe::name_can_be_queried(lp)) {
+                ++unqueryable;
+                rodsLog(LOG_ERROR, "irods_policy_data_replication - [%s] cannot be named within a query", lp.c_str());
+                continue;
+            }
+
+            auto itr = objects.find(lp);
+            if(itr == objects.end()) {
+                ++missing;
+                rodsLog(LOG_NOTICE, "irods_policy_data_replication - no good replica found for [%s]", lp.c_str());
+            }
+            else if(itr->second.on_destination) {
+                ++existing;
+            }
+            else {
+                pending.push_back(lp);
+            }
+        }
+
+        const auto admin = comm->clientUser.authInfo.authFlag >= LOCAL_PRIV_USER_AUTH;
+        const replication repl{_source_resource, _destination_resource};
+
+        std::atomic<uint32_t>   failed{};
+        std::atomic<int>        error_code{};
+        std::atomic<rodsLong_t> bytes{};
+
+        auto repl_fcn = [&](auto& comm) {
+            if(pending.empty()) {
+                return 0;
+            }
+
+            irods::thread_pool pool{std::min<uint32_t>(number_of_threads, pending.size())};
+            for(const auto& lp : pending) {
+                irods::thread_pool::post(pool, [&] {
+                    const auto size = objects.at(lp).size;
+                    const auto ret = replicate_object(_ctx, comm, lp, repl, admin, size);
+                    if(ret < 0) {
+                        ++failed;
+                        error_code = ret;
+                        rodsLog(LOG_ERROR,
+                                "irods_policy_data_replication - failed to replicate [%s] from [%s] to [%s]",
+                                lp.c_str(),
+                                _source_resource.c_str(),
+                                _destination_resource.c_str());
+                        return;
+                    }
+
+                    bytes += size;
+                });
+            }
+
+            pool.join();
+
+            return 0;
+        };
+
+        pc::exec_as_user(*comm, _user_name, repl_fcn);
+
+        const auto seconds    = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+        const auto replicated = static_cast<uint32_t>(pending.size()) - failed.load();
+
+        const json report{
+            {"objects",            logical_paths.size()},
+            {"replicated",         replicated},
+            {"already_replicated", existing},
+            {"missing",            missing},
+            {"failed",             failed.load() + unqueryable},
+            {"bytes",              bytes.load()},
+            {"seconds",            seconds},
+            {"objects_per_second", seconds > 0 ? replicated / seconds : 0.0},
+            {"mb_per_second",      seconds > 0 ? bytes.load() / seconds / (1024.0 * 1024.0) : 0.0}};
+
+        pe::client_message({{"0.message", fmt::format("{} bulk replication to {}", _ctx.policy_name, _destination_resource)},
+                            {"1.report", report.dump()}});
+
+        if(_out) {
+            *_out = report.dump();
+        }
+
+        if(failed > 0 || unqueryable > 0) {
+            return ERROR(
+                       failed > 0 ? error_code.load() : SYS_INVALID_INPUT_PARAM,
+                       boost::format("%s - failed to replicate %d of %d objects to [%s]")
+                       % _ctx.policy_name
+                       % (failed.load() + unqueryable)
+                       % (pending.size() + unqueryable)
+                       % _destination_resource);
+        }
+
+        return SUCCESS();
+
+    } // bulk_replication
+
+    // the size of the good replicas of an object and whether each destination holds
+    // a good or a stale replica, a destination holding neither is missing a replica
+    struct refresh_object {
+        rodsLong_t            size{-1};
+        std::set<std::string> good;
+        std::set<std::string> stale;
+    };
+
+    auto resolve_refresh_objects(
+          rsComm_t*                       _comm
+        , const std::vector<std::string>& _destination_resources
+        , const std::vector<std::string>& _logical_paths
+        , uint32_t                        _batch_size) -> std::map<std::string, refresh_object>
+    {
+        using fsp = irods::experimental::filesystem::path;
+
+        std::map<std::string, refresh_object> objects{};
+
+        // a single query per batch gathers every replica, each is attributed to the
+        // destinations named within its hierarchy
+        pe::for_each_name_batch(_logical_paths, _batch_size, [&](const auto& coll_name, const auto& in_list) {
+            irods::query<rsComm_t> qobj{_comm, fmt::format(
+                                                   "SELECT DATA_NAME, DATA_RESC_HIER, DATA_REPL_STATUS, DATA_SIZE WHERE COLL_NAME = '{}' AND DATA_NAME IN ({})"
+                                                   , coll_name
+                                                   , in_list)};
+            for(const auto& row : qobj) {
+                auto& obj = objects[(fsp{coll_name} / fsp{row[0]}).string()];
+                const auto good = row[2] == "1";
+
+                if(good) {
+                    obj.size = std::stoll(row[3]);
+                }
+
+                irods::hierarchy_parser parser{};
+                parser.set_string(row[1]);
+                for(const auto& dest : _destination_resources) {
+                    if(!parser.resc_in_hier(dest)) {
+                        continue;
+                    }
+
+                    if(good) {
+                        obj.good.insert(dest);
+                        obj.stale.erase(dest);
+                    }
+                    else if(obj.good.count(dest) == 0) {
+                        obj.stale.insert(dest);
+                    }
+                }
+            }
+        });
+
+        return objects;
+
+    } // resolve_refresh_objects
+
+    auto refresh_enabled(const pe::context& _ctx) -> bool
+    {
+        return pc::get(_ctx.configuration, "refresh", std::string{}) == "true";
+    } // refresh_enabled
+
+    // classifies the replicas of each object on every destination as good, stale or
+    // missing with one query per batch of objects, then updates stale replicas in
+    // place and creates missing ones across a pool of number_of_threads workers,
+    // largest objects first
+    auto refresh_replicas(
+          const pe::context&              _ctx
+        , pe::arg_type                    _out
+        , const std::string&              _user_name
+        , const std::vector<std::string>& _logical_paths
+        , const std::string&              _source_resource
+        , const std::vector<std::string>& _destination_resources) -> irods::error
+    {
+        auto comm = _ctx.rei->rsComm;
+
+        const auto batch_size        = std::max(pc::get(_ctx.configuration, "bulk_batch_size", uint32_t{100}), 1u);
+        const auto number_of_threads = std::max(pc::get(_ctx.configuration, "number_of_threads", uint32_t{4}), 1u);
+
+        const auto objects = resolve_refresh_objects(comm, _destination_resources, _logical_paths, batch_size);
+
+        struct task {
+            std::string logical_path;
+            std::string destination;
+            rodsLong_t  size;
+            bool        stale;
+        };
+
+        std::vector<task> tasks{};
+        uint32_t good{}, missing{}, unqueryable{};
+
+        for(const auto& lp : _logical_paths) {
+            // each replica the object would need is counted as failed
+            if(!pe::name_can_be_queried(lp)) {
+                unqueryable += _destination_resources.size();
+                rodsLog(LOG_ERROR, "irods_policy_data_replication - [%s] cannot be named within a query", lp.c_str());
+                continue;
+            }
+
+            auto itr = objects.find(lp);
+            if(itr == objects.end() || itr->second.size < 0) {
+                ++missing;
+                rodsLog(LOG_NOTICE, "irods_policy_data_replication - no good replica found for [%s]", lp.c_str());
+                continue;
+            }
+
+            const auto& obj = itr->second;
+            for(const auto& dest : _destination_resources) {
+                if(obj.good.count(dest) > 0) {
+                    ++good;
+                }
+                else {
+                    tasks.push_back({lp, dest, obj.size, obj.stale.count(dest) > 0});
+                }
+            }
+        }
+
+        std::stable_sort(tasks.begin(), tasks.end(), [](const auto& a, const auto& b) {
+            return a.size > b.size;
+        });
+
+        const auto admin = comm->clientUser.authInfo.authFlag >= LOCAL_PRIV_USER_AUTH;
+
+        std::atomic<uint32_t> updated{}, created{}, failed{};
+        std::atomic<int>      error_code{};
+
+        auto repl_fcn = [&](auto& comm) {
+            if(tasks.empty()) {
+                return 0;
+            }
+
+            irods::thread_pool pool{std::min<uint32_t>(number_of_threads, tasks.size())};
+            for(const auto& t : tasks) {
+                irods::thread_pool::post(pool, [&] {
+                    const auto ret = replicate_object(_ctx, comm, t.logical_path, {_source_resource, t.destination}, admin, t.size);
+                    if(ret < 0) {
+                        ++failed;
+                        error_code = ret;
+                        rodsLog(LOG_ERROR,
+                                "irods_policy_data_replication - failed to %s replica of [%s] on [%s]",
+                                t.stale ? "update" : "create",
+                                t.logical_path.c_str(),
+                                t.destination.c_str());
+                        return;
+                    }
+
+                    ++(t.stale ? updated : created);
+                });
+            }
+
+            pool.join();
+
+            return 0;
+        };
+
+        pc::exec_as_user(*comm, _user_name, repl_fcn);
+
+        const json report{
+            {"objects", _logical_paths.size()},
+            {"updated", updated.load()},
+            {"created", created.load()},
+            {"good",    good},
+            {"missing", missing},
+            {"failed",  failed.load() + unqueryable}};
+
+        pe::client_message({{"0.message", fmt::format("{} refreshed replicas from {}", _ctx.policy_name, _source_resource)},
+                            {"1.report", report.dump()}});
+
+        if(_out) {
+            *_out = report.dump();
+        }
+
+        if(failed > 0 || unqueryable > 0) {
+            return ERROR(
+                       failed > 0 ? error_code.load() : SYS_INVALID_INPUT_PARAM,
+                       boost::format("%s - failed to refresh %d of %d replicas")
+                       % _ctx.policy_name
+                       % (failed.load() + unqueryable)
+                       % (tasks.size() + unqueryable));
+        }
+
+        return SUCCESS();
+
+    } // refresh_replicas
 
     auto replication_policy(const pe::context ctx, pe::arg_type out)
     {
+        if(ctx.parameters.contains("block_digests")) {
+            return report_block_digests(ctx, out);
+        }
+
         auto comm = ctx.rei->rsComm;
 
         auto [user_name, logical_path, source_resource, destination_resource] =
@@ -88,6 +939,29 @@ namespace {
                                ? pc::get(ctx.configuration, "destination_resource", std::string{})
                                : destination_resource;
 
+        if(refresh_enabled(ctx)) {
+            std::vector<std::string> destinations{};
+            if(!destination_resource.empty()) {
+                destinations.push_back(destination_resource);
+            }
+            else {
+                const auto src_dst_map = pc::get(ctx.configuration, "source_to_destination_map", json{});
+                if(src_dst_map.contains(source_resource)) {
+                    destinations = src_dst_map.at(source_resource).get<std::vector<std::string>>();
+                }
+            }
+
+            const auto logical_paths = ctx.parameters.contains("logical_paths")
+                                       ? ctx.parameters.at("logical_paths").get<std::vector<std::string>>()
+                                       : std::vector<std::string>{logical_path};
+
+            return refresh_replicas(ctx, out, user_name, logical_paths, source_resource, destinations);
+        }
+
+        if(ctx.parameters.contains("logical_paths")) {
+            return bulk_replication(ctx, out, user_name, source_resource, destination_resource);
+        }
+
         pe::client_message({{"0.usage", fmt::format("{} requires user_name, logical_path, source_resource, destination_resource or source_to_destination_map", ctx.policy_name)},
                             {"1.user_name", user_name},
                             {"2.logical_path", logical_path},
@@ -99,19 +973,14 @@ namespace {
                                 {"1.message", fmt::format("{} replicating {} from {} to {}", ctx.policy_name, logical_path, source_resource, destination_resource)}});
 
             // direct call invocation
-            int err = replicate_object_to_resource(
-                            comm
-                          , user_name
-                          , logical_path
-                          , source_resource
-                          , destination_resource);
-            if(err < 0) {
-                return ERROR(
-                          err,
-                          boost::format("failed to replicate [%s] from [%s] to [%s]")
-                          % logical_path
-                          % source_resource
-                          % destination_resource);
+            auto failures = replicate_object_to_resources(
+                                ctx
+                              , comm
+                              , user_name
+                              , logical_path
+                              , {{source_resource, destination_resource}});
+            if(!failures.empty()) {
+                return make_replication_error(logical_path, source_resource, failures);
             }
         }
         else {
@@ -134,28 +1003,20 @@ namespace {
 
             auto dst_resc_arr{src_dst_map.at(source_resource)};
             auto destination_resources = dst_resc_arr.get<std::vector<std::string>>();
-            irods::error ret{SUCCESS()};
 
-            for( auto& dest : destination_resources) {
+            for(const auto& dest : destination_resources) {
                 pe::client_message({{"0.message", fmt::format("{} replicating {} from {} to {}", ctx.policy_name, logical_path, source_resource, dest)}});
+            }
 
-                int err = replicate_object_to_resource(
-                                comm
+            auto failures = replicate_object_with_topology(
+                                ctx
+                              , comm
                               , user_name
                               , logical_path
                               , source_resource
-                              , dest);
-                if(err < 0) {
-                    ret = PASSMSG(
-                              boost::str(boost::format("failed to replicate [%s] from [%s] to [%s]")
-                              % logical_path
-                              % source_resource),
-                              ret);
-                }
-            }
-
-            if(!ret.ok()) {
-                return ret;
+                              , destination_resources);
+            if(!failures.empty()) {
+                return make_replication_error(logical_path, source_resource, failures);
             }
         }
 
@@ -5,13 +5,22 @@
 #include <irods/irods_server_api_call.hpp>
 #include <irods/irods_resource_manager.hpp>
 #include <irods/irods_hierarchy_parser.hpp>
+#include <irods/thread_pool.hpp>
 
 #include <nlohmann/json.hpp>
 
 #include <algorithm>
+#include <atomic>
+#include <chrono>
 #include <iostream>
+#include <map>
+#include <set>
 
+#include "catalog_batch.hpp"
+#include "lru_cache.hpp"
 #include "parameter_substitution.hpp"
+#include "throttle.hpp"
+#include "vault_usage.hpp"
 
 extern irods::resource_manager resc_mgr;
 
@@ -23,47 +32,129 @@ namespace {
     namespace kw                  = irods::policy_composition::keywords;
     namespace pe                  = irods::policy_composition::policy_engine;
     using     string_vector       = std::vector<std::string>;
-    using     string_tuple_vector = std::vector<std::tuple<std::string, std::string>>;
     // clang-format on
 
     namespace retention_mode {
         static const std::string remove_all{"remove_all_replicas"};
         static const std::string trim_single{"trim_single_replica"};
+        static const std::string trim_by_capacity{"trim_by_capacity"};
     };
 
     auto mode_is_supported(const std::string& m) -> bool
     {
-        return (m == retention_mode::remove_all || m == retention_mode::trim_single);
+        return (m == retention_mode::remove_all || m == retention_mode::trim_single || m == retention_mode::trim_by_capacity);
     }
 
-    auto get_source_resource(
-          rsComm_t*          comm
-        , const std::string& logical_path
-        , const std::string& destination_resource) -> std::string
+    // the catalog attributes of one replica of a data object, the root is the first
+    // resource within its hierarchy
+    struct replica_fact {
+        std::string resource;
+        std::string resource_id;
+        std::string hierarchy;
+        std::string root;
+        std::string replica_number;
+        std::string status;
+        rodsLong_t  size{};
+    };
+
+    using replica_facts = std::vector<replica_fact>;
+
+    // gathers every replica of an object with a single query
+    auto get_replica_facts(rsComm_t* comm, const std::string& logical_path) -> replica_facts
     {
         fs::path path{logical_path};
         const auto coll_name = path.parent_path();
         const auto data_name = path.object_name();
 
-        // query for list of all participating resources
         auto qstr{boost::str(boost::format(
-                  "SELECT RESC_NAME WHERE COLL_NAME = '%s' AND DATA_NAME = '%s'")
+                  "SELECT RESC_NAME, RESC_ID, DATA_RESC_HIER, DATA_REPL_NUM, DATA_REPL_STATUS, DATA_SIZE WHERE COLL_NAME = '%s' AND DATA_NAME = '%s'")
                   % coll_name.string()
                   % data_name.string())};
 
         irods::query qobj{comm, qstr};
 
+        replica_facts facts{};
+        for(auto&& r : qobj) {
+            irods::hierarchy_parser p(r[2]);
+            facts.push_back({r[0], r[1], r[2], p.first_resc(), r[3], r[4], std::stoll(r[5])});
+        }
+
+        return facts;
+
+    } // get_replica_facts
+
+    // the preservation set for each attribute, shared by every invocation within the agent.
+    // a change made through another agent is observed once the entry expires
+    auto get_preservation_cache(const pe::context& ctx) -> pe::lru_cache<std::string, std::set<std::string>>&
+    {
+        static pe::lru_cache<std::string, std::set<std::string>> cache{
+            16, std::chrono::seconds{pc::get(ctx.configuration, "preservation_cache_ttl_seconds", uint32_t{300})}};
+        return cache;
+    } // get_preservation_cache
+
+    // true for a METADATA event on a resource, as sent by the metadata_modified handler
+    auto is_resource_metadata_event(const pe::context& ctx) -> bool
+    {
+        if(pc::get(ctx.parameters, kw::event, std::string{}) != "METADATA") {
+            return false;
+        }
+
+        const auto metadata = pc::get(ctx.parameters, kw::metadata, json{});
+
+        return pc::get(metadata, kw::entity_type, std::string{}) == "resource";
+
+    } // is_resource_metadata_event
+
+    // true when invoked by a dry run of the query processor, the removals which would be
+    // issued are reported rather than applied
+    auto dry_run_enabled(const pe::context& ctx) -> bool
+    {
+        return pc::get(ctx.parameters, "dry_run", std::string{}) == "true";
+    } // dry_run_enabled
+
+    // the names of all resources carrying the preservation attribute
+    auto get_preservation_set(
+          const pe::context& ctx
+        , rsComm_t*          comm
+        , const std::string& attribute) -> std::set<std::string>
+    {
+        auto& cache = get_preservation_cache(ctx);
+        if(const auto resources = cache.get(attribute)) {
+            return *resources;
+        }
+
+        auto qstr = boost::str(boost::format(
+                    "SELECT RESC_NAME WHERE META_RESC_ATTR_NAME = '%s'")
+                    % attribute);
+        irods::query qobj{comm, qstr};
+
+        std::set<std::string> resources{};
+        for(auto&& r : qobj) {
+            resources.insert(r[0]);
+        }
+
+        cache.put(attribute, resources);
+
+        return resources;
+
+    } // get_preservation_set
+
+    auto get_source_resource(
+          const replica_facts& facts
+        , const std::string&   logical_path
+        , const std::string&   destination_resource) -> std::string
+    {
         // if there are more than two replicas and no source resource has been
         // specificied, this is a usage error
-        if(qobj.size() > 2) {
+        if(facts.size() > 2) {
             THROW(SYS_INVALID_INPUT_PARAM,
                   fmt::format("Multiple replicas found with no specified source resource for [{}]",
                   logical_path));
         }
 
-        for(auto&& rn : qobj) {
-            if(rn[0] != destination_resource) {
-                return rn[0];
+        for(auto&& f : facts) {
+            if(f.resource != destination_resource) {
+                return f.resource;
             }
         }
 
@@ -73,221 +164,593 @@ namespace {
 
     } // get_source_resource
 
-    auto get_replica_number_for_resource(
-          rsComm_t*          comm
-        , const std::string& logical_path
-        , const std::string& source_resource) -> std::string
-    {
-        fs::path path{logical_path};
-        const auto coll_name = path.parent_path();
-        const auto data_name = path.object_name();
-
-        // query for list of all participating resources
-        auto qstr{boost::str(boost::format(
-                  "SELECT DATA_REPL_NUM WHERE COLL_NAME = '%s' AND DATA_NAME = '%s' AND RESC_NAME = '%s'")
-                  % coll_name.string()
-                  % data_name.string()
-                  % source_resource)};
-
-        irods::query qobj{comm, qstr};
-
-        return qobj.size() > 0 ? qobj.front()[0] : "INVALID_REPLICA_NUMBER";
-
-    } // get_replica_number_for_resource
-
-    auto remove_data_object(
+    // removes a data object, or a single replica if a replica number is given, as the
+    // user already set upon the connection.  without force an unlinked data object is
+    // moved to the trash, deferring the deletion of its physical files
+    auto remove_replica(
           int                api_index
-        , rsComm_t*          comm
-        , const std::string& user_name
+        , rsComm_t&          comm
         , const std::string& logical_path
-        , const std::string& source_resource = {}) -> int
+        , const std::string& replica_number
+        , bool               admin
+        , bool               force) -> int
     {
         dataObjInp_t obj_inp{};
         memset(&obj_inp, 0, sizeof(obj_inp));
         rstrcpy(obj_inp.objPath, logical_path.c_str(), sizeof(obj_inp.objPath));
 
-        if(comm->clientUser.authInfo.authFlag >= LOCAL_PRIV_USER_AUTH) {
+        if(admin) {
             addKeyVal(&obj_inp.condInput, ADMIN_KW, "true" );
         }
 
         addKeyVal(&obj_inp.condInput, COPIES_KW, "1" );
 
-        std::string repl_num{};
+        if(!replica_number.empty()) {
+            addKeyVal(&obj_inp.condInput, REPL_NUM_KW, replica_number.c_str());
+        }
 
-        if(!source_resource.empty()) {
-            repl_num = get_replica_number_for_resource(comm, logical_path, source_resource);
-            addKeyVal(&obj_inp.condInput, REPL_NUM_KW, repl_num.c_str());
+        if(force) {
+            addKeyVal(&obj_inp.condInput, FORCE_FLAG_KW, "");
         }
 
+        const auto ret = irods::server_api_call(api_index, &comm, &obj_inp);
+        clearKeyVal(&obj_inp.condInput);
+
+        return ret;
+
+    } // remove_replica
+
+    auto remove_data_object(
+          int                api_index
+        , rsComm_t*          comm
+        , const std::string& user_name
+        , const std::string& logical_path
+        , const std::string& replica_number = {}) -> int
+    {
+        const auto admin = comm->clientUser.authInfo.authFlag >= LOCAL_PRIV_USER_AUTH;
+
         auto trim_fcn = [&](auto& comm) {
-            return irods::server_api_call(api_index, &comm, &obj_inp);
+            return remove_replica(api_index, comm, logical_path, replica_number, admin, false);
         };
 
         return pc::exec_as_user(*comm, user_name, trim_fcn);
 
     } // remove_data_object
 
-    auto get_leaf_resources_for_object(rsComm_t* comm, const std::string& logical_path) -> string_vector
+    // the replica whose hierarchy contains the given root resource
+    auto get_replica_for_root(
+          const replica_facts& facts
+        , const std::string&   source_resource) -> const replica_fact*
     {
-        namespace fs = irods::experimental::filesystem;
+        for(auto&& f : facts) {
+            irods::hierarchy_parser p(f.hierarchy);
+            if(p.resc_in_hier(source_resource)) {
+                return &f;
+            }
+        }
 
-        fs::path path{logical_path};
-        const auto coll_name = path.parent_path();
-        const auto data_name = path.object_name();
+        return nullptr;
 
-        // query for list of all participating resources
-        auto qstr{boost::str(boost::format(
-                  "SELECT RESC_NAME WHERE COLL_NAME = '%s' AND DATA_NAME = '%s'")
-                  % coll_name.string()
-                  % data_name.string())};
+    } // get_replica_for_root
 
-        irods::query qobj{comm, qstr};
+    auto in_whitelist(
+        const string_vector& whitelist
+      , const std::string&   resource)
+    {
+        return whitelist.empty() ||
+               std::find(whitelist.begin(), whitelist.end(), resource) != whitelist.end();
 
-        string_vector resources{};
-        for(auto r : qobj) {
-            resources.push_back(r[0]);
+    } // in_whitelist
+
+    // the replicas which may be removed, those on a root resource within the white list
+    // without preservation metadata.  all replicas may be removed with an unlink, not a trim
+    auto determine_replicas_for_unlink(
+          const replica_facts&         facts
+        , const std::set<std::string>& preservation_set
+        , const string_vector&         whitelist)
+    {
+        replica_facts tmp{};
+        for(auto&& f : facts) {
+            if(in_whitelist(whitelist, f.root) && preservation_set.count(f.root) == 0) {
+                tmp.push_back(f);
+            }
         }
 
-        return resources;
+        // if identical to original list then we unlink, not trim
+        auto unlink = (facts.size() == tmp.size());
+
+        return std::make_tuple(unlink, tmp);
+
+    } // determine_replicas_for_unlink
+
+    auto object_can_be_trimmed(
+        const std::set<std::string>& preservation_set
+      , const std::string&           source_resource
+      , const string_vector&         whitelist)
+    {
+        if(!in_whitelist(whitelist, source_resource)) {
+            return false;
+        }
+
+        return preservation_set.count(source_resource) == 0;
 
-    } // get_leaf_resources_for_object
+    } // object_can_be_trimmed
+
+    // the owner and replicas of each of a list of data objects, gathered with one query
+    // per collection and batch of names
+    struct bulk_object {
+        std::string   owner;
+        replica_facts facts;
+    };
 
-    auto get_leaf_resource_for_root(
-        rsComm_t* comm
-      , const std::string& source_resource
-      , const std::string& logical_path) -> std::string
+    auto get_bulk_replica_facts(
+          rsComm_t*            comm
+        , const string_vector& logical_paths
+        , uint32_t             batch_size) -> std::map<std::string, bulk_object>
     {
-        namespace fs = irods::experimental::filesystem;
+        std::map<std::string, bulk_object> objects{};
 
-        fs::path path{logical_path};
-        const auto coll_name = path.parent_path();
-        const auto data_name = path.object_name();
+        pe::for_each_name_batch(logical_paths, batch_size, [&](const auto& coll_name, const auto& in_list) {
+            auto qstr{fmt::format(
+                      "SELECT DATA_NAME, DATA_OWNER_NAME, RESC_NAME, RESC_ID, DATA_RESC_HIER, DATA_REPL_NUM, DATA_REPL_STATUS, DATA_SIZE WHERE COLL_NAME = '{}' AND DATA_NAME IN ({})"
+                      , coll_name
+                      , in_list)};
 
-        auto leaf_bundle = pe::compute_leaf_bundle(source_resource);
+            irods::query qobj{comm, qstr};
+            for(auto&& r : qobj) {
+                auto& obj = objects[(fs::path{coll_name} / fs::path{r[0]}).string()];
+                obj.owner = r[1];
 
-        auto qstr{boost::str(boost::format(
-                  "SELECT RESC_NAME WHERE COLL_NAME = '%s' AND DATA_NAME = '%s' AND RESC_ID IN (%s)")
-                  % coll_name.string()
-                  % data_name.string()
-                  % leaf_bundle)};
+                irods::hierarchy_parser p(r[4]);
+                obj.facts.push_back({r[2], r[3], r[4], p.first_resc(), r[5], r[6], std::stoll(r[7])});
+            }
+        });
 
-        irods::query qobj{comm, qstr};
+        return objects;
+
+    } // get_bulk_replica_facts
 
-        return qobj.size() > 0 ? qobj.front()[0] : std::string{};
+    // an unlink of a data object or a trim of one of its replicas
+    struct removal {
+        std::string logical_path;
+        int         api_index;
+        std::string replica_number;
+        std::string resource;
+        rodsLong_t  bytes;
+    };
 
-    } // get_leaf_resource_for_root
+    using removals_by_owner_type = std::map<std::string, std::vector<removal>>;
 
-    auto get_root_resources_for_leaves(rsComm_t* comm, const string_vector& leaf_resources)
+    struct removal_counts {
+        uint32_t   unlinked{};
+        uint32_t   trimmed{};
+        uint32_t   failed{};
+        int        error_code{};
+        rodsLong_t bytes_reclaimed{};
+    };
+
+    // issues the removals for each owner within a single change of user, across a pool
+    // of number_of_threads workers
+    auto remove_replicas_by_owner(
+          const pe::context&            ctx
+        , const removals_by_owner_type& removals_by_owner
+        , uint32_t                      number_of_threads
+        , bool                          defer_deletion) -> removal_counts
     {
-        std::vector<std::tuple<std::string, std::string>> roots_and_leaves;
-        for(auto&& l : leaf_resources) {
-            std::string hier{};
-            irods::error err = resc_mgr.get_hier_to_root_for_resc(l, hier);
+        auto comm = ctx.rei->rsComm;
+
+        const auto admin = comm->clientUser.authInfo.authFlag >= LOCAL_PRIV_USER_AUTH;
+
+        std::atomic<uint32_t>   unlinked{}, trimmed{}, failed{};
+        std::atomic<int>        error_code{};
+        std::atomic<rodsLong_t> bytes_reclaimed{};
+
+        for(const auto& entry : removals_by_owner) {
+            const auto& owner    = entry.first;
+            const auto& removals = entry.second;
+
+            if(removals.empty()) {
+                continue;
+            }
+
+            auto remove_fcn = [&](auto& comm) {
+                irods::thread_pool pool{std::min<uint32_t>(number_of_threads, removals.size())};
+                for(const auto& r : removals) {
+                    irods::thread_pool::post(pool, [&] {
+                        pe::apply_throttle(ctx.policy_name, ctx.configuration, {r.resource});
+
+                        const auto ret = remove_replica(r.api_index, comm, r.logical_path, r.replica_number, admin, !defer_deletion);
+                        if(ret < 0) {
+                            ++failed;
+                            error_code = ret;
+                            rodsLog(LOG_ERROR,
+                                    "irods_policy_data_retention - failed to remove [%s] replica [%s]",
+                                    r.logical_path.c_str(),
+                                    r.replica_number.c_str());
+                            return;
+                        }
+
+                        ++(DATA_OBJ_UNLINK_AN == r.api_index ? unlinked : trimmed);
+                        bytes_reclaimed += r.bytes;
+                    });
+                }
+
+                pool.join();
 
-            irods::hierarchy_parser p(hier);
-            roots_and_leaves.push_back(std::make_tuple(p.first_resc(), l));
+                return 0;
+            };
+
+            // none of the removals for an owner are issued if the change of user fails
+            int ret{};
+            try {
+                ret = pc::exec_as_user(*comm, owner, remove_fcn);
+            }
+            catch(const irods::exception& e) {
+                ret = e.code();
+            }
+
+            if(ret < 0) {
+                failed     += removals.size();
+                error_code  = ret;
+                rodsLog(LOG_ERROR,
+                        "irods_policy_data_retention - failed to act as [%s] for [%lu] removals [%d]",
+                        owner.c_str(),
+                        removals.size(),
+                        ret);
+            }
         }
 
-        return roots_and_leaves;
+        return {unlinked.load(), trimmed.load(), failed.load(), error_code.load(), bytes_reclaimed.load()};
 
-    } // get_root_resources_for_leaves
+    } // remove_replicas_by_owner
 
-    auto filter_roots_and_leaves_by_whitelist(
-        const string_vector&       whitelist
-      , const string_tuple_vector& roots_and_leaves)
+    // the counts which would result should every planned removal succeed
+    auto count_planned_removals(const removals_by_owner_type& removals_by_owner) -> removal_counts
     {
-        if(whitelist.empty()) {
-            return roots_and_leaves;
-        }
+        removal_counts counts{};
 
-        string_tuple_vector tmp{};
-        for(auto&& rl : roots_and_leaves) {
-            if(std::find(whitelist.begin(), whitelist.end(), std::get<0>(rl)) != whitelist.end()) {
-                tmp.push_back(rl);
+        for(const auto& entry : removals_by_owner) {
+            for(const auto& r : entry.second) {
+                ++(DATA_OBJ_UNLINK_AN == r.api_index ? counts.unlinked : counts.trimmed);
+                counts.bytes_reclaimed += r.bytes;
             }
         }
 
-        return tmp;
+        return counts;
+
+    } // count_planned_removals
+
+    // applies the retention mode to each of logical_paths.  the removals are grouped by
+    // the owner of each object such that each owner costs a single change of user, and
+    // are issued across a pool of number_of_threads workers
+    auto bulk_retention(
+          const pe::context&   ctx
+        , pe::arg_type         out
+        , const std::string&   mode
+        , const std::string&   source_resource
+        , const std::string&   destination_resource
+        , const string_vector& whitelist
+        , const std::string&   attribute) -> irods::error
+    {
+        auto comm = ctx.rei->rsComm;
 
-    } // filter_roots_and_leaves_by_whitelist
+        const auto logical_paths     = ctx.parameters.at("logical_paths").get<string_vector>();
+        const auto batch_size        = pc::get(ctx.configuration, "bulk_batch_size", uint32_t{100});
+        const auto number_of_threads = std::max(pc::get(ctx.configuration, "number_of_threads", uint32_t{4}), 1u);
+        const auto defer_deletion    = pc::get(ctx.configuration, "defer_physical_deletion", std::string{"true"}) == "true";
 
-    bool resource_has_preservation_metadata(
-          rsComm_t*            comm
-        , const std::string&   attribute
-        , const std::string&   resource)
-    {
-        auto qstr = boost::str(boost::format(
-                    "SELECT META_RESC_ATTR_VALUE WHERE RESC_NAME = '%s' AND META_RESC_ATTR_NAME = '%s'")
-                    % resource
-                    % attribute);
-        irods::query qobj{comm, qstr};
+        const auto objects          = get_bulk_replica_facts(comm, logical_paths, batch_size);
+        const auto preservation_set = get_preservation_set(ctx, comm, attribute);
 
-        return qobj.size() != 0;
+        removals_by_owner_type removals_by_owner{};
+        uint32_t missing{}, skipped{}, failed_to_plan{};
 
-    } // resource_has_preservation_metadata
+        for(const auto& lp : logical_paths) {
+            if(!pe::name_can_be_queried(lp)) {
+                ++failed_to_plan;
+                rodsLog(LOG_ERROR, "irods_policy_data_retention - [%s] cannot be named within a query", lp.c_str());
+                continue;
+            }
 
-    auto filter_roots_and_leaves_by_preservation_metadata(
-          rsComm_t*                  comm
-        , const std::string&         attribute
-        , const string_tuple_vector& roots_and_leaves)
-    {
-        string_tuple_vector tmp{};
-        for(auto&& rl : roots_and_leaves) {
-            if(!resource_has_preservation_metadata(comm, attribute, std::get<0>(rl))) {
-                tmp.push_back(rl);
+            auto itr = objects.find(lp);
+            if(itr == objects.end()) {
+                ++missing;
+                continue;
+            }
+
+            const auto& [owner, facts] = itr->second;
+            auto& removals = removals_by_owner[owner];
+            const auto planned = removals.size();
+
+            if(mode == retention_mode::remove_all) {
+                auto [unlink, replicas_to_remove] = determine_replicas_for_unlink(facts, preservation_set, whitelist);
+
+                if(unlink) {
+                    rodsLong_t bytes{};
+                    for(auto&& r : replicas_to_remove) {
+                        bytes += r.size;
+                    }
+
+                    removals.push_back({lp, DATA_OBJ_UNLINK_AN, {}, {}, bytes});
+                }
+                else {
+                    for(auto&& r : replicas_to_remove) {
+                        removals.push_back({lp, DATA_OBJ_TRIM_AN, r.replica_number, r.resource, r.size});
+                    }
+                }
+            }
+            else {
+                try {
+                    const auto src = source_resource.empty()
+                                     ? get_source_resource(facts, lp, destination_resource)
+                                     : source_resource;
+
+                    if(object_can_be_trimmed(preservation_set, src, whitelist)) {
+                        if(const auto replica = get_replica_for_root(facts, src)) {
+                            removals.push_back({lp, DATA_OBJ_TRIM_AN, replica->replica_number, replica->resource, replica->size});
+                        }
+                    }
+                }
+                catch(const irods::exception& e) {
+                    ++failed_to_plan;
+                    rodsLog(LOG_ERROR, "%s", e.client_display_what());
+                    continue;
+                }
+            }
+
+            if(removals.size() == planned) {
+                ++skipped;
             }
         }
 
-        return tmp;
+        const auto dry_run = dry_run_enabled(ctx);
+        const auto counts  = dry_run
+                             ? count_planned_removals(removals_by_owner)
+                             : remove_replicas_by_owner(ctx, removals_by_owner, number_of_threads, defer_deletion);
+
+        const json report{
+            {"dry_run",         dry_run},
+            {"objects",         logical_paths.size()},
+            {"unlinked",        counts.unlinked},
+            {"trimmed",         counts.trimmed},
+            {"skipped",         skipped},
+            {"missing",         missing},
+            {"failed",          counts.failed + failed_to_plan},
+            {"bytes_reclaimed", counts.bytes_reclaimed},
+            {"deferred",        defer_deletion}};
+
+        pe::client_message({{"0.message", fmt::format("{} bulk retention with mode {}", ctx.policy_name, mode)},
+                            {"1.report", report.dump()}});
+
+        if(out) {
+            *out = report.dump();
+        }
 
-    } // filter_roots_and_leaves_by_preservation_metadata
+        if(counts.failed > 0 || failed_to_plan > 0) {
+            return ERROR(
+                       counts.failed > 0 ? counts.error_code : SYS_INVALID_INPUT_PARAM,
+                       boost::format("%s - failed to apply retention to %d of %d objects")
+                       % ctx.policy_name
+                       % (counts.failed + failed_to_plan)
+                       % logical_paths.size());
+        }
 
-    auto determine_resource_list_for_unlink(
-          rsComm_t*            comm
-        , const std::string&   attribute
-        , const std::string&   logical_path
-        , const string_vector& whitelist)
+        return SUCCESS();
+
+    } // bulk_retention
+
+    // trims the least recently accessed replicas from a resource once the filesystem
+    // holding its vault reaches the high watermark, a batch at a time, sampling the usage
+    // after each batch until it falls below the low watermark.  candidates are the good
+    // replicas on the resource carrying the access time attribute, in the order of its
+    // value, whose data object holds a good replica on another resource
+    auto capacity_retention(
+          const pe::context&   ctx
+        , pe::arg_type         out
+        , const std::string&   source_resource
+        , const string_vector& whitelist
+        , const std::string&   attribute) -> irods::error
     {
-        // need to convert leaves to roots and then determine if
-        // 1. it is in the white list
-        // 2. if it has preservation metadata
+        auto comm = ctx.rei->rsComm;
+
+        if(source_resource.empty()) {
+            return ERROR(
+                       SYS_INVALID_INPUT_PARAM,
+                       boost::format("%s - %s requires a source_resource")
+                       % ctx.policy_name
+                       % retention_mode::trim_by_capacity);
+        }
 
-        auto leaf_resources = get_leaf_resources_for_object(comm, logical_path);
-        auto roots_and_leaves = get_root_resources_for_leaves(comm, leaf_resources);
-        roots_and_leaves = filter_roots_and_leaves_by_whitelist(whitelist, roots_and_leaves);
-        roots_and_leaves = filter_roots_and_leaves_by_preservation_metadata(comm, attribute, roots_and_leaves);
+        const auto high_watermark        = pc::get(ctx.configuration, "high_watermark", 90.0);
+        const auto low_watermark         = pc::get(ctx.configuration, "low_watermark",  80.0);
+        const auto batch_size            = std::max(pc::get(ctx.configuration, "trim_batch_size", uint32_t{100}), 1u);
+        const auto number_of_threads     = std::max(pc::get(ctx.configuration, "number_of_threads", uint32_t{4}), 1u);
+        const auto access_time_attribute = pc::get(ctx.configuration, "access_time_attribute", std::string{"irods::access_time"});
+
+        double percent_used_before{}, percent_used{};
+        std::string vault_path{};
+
+        // the usage is read from the local filesystem, which says nothing of a vault on
+        // another server, and is not read from a parent of a missing vault as a trim acts on it
+        try {
+            if(!pe::resource_is_local(source_resource)) {
+                return ERROR(
+                           SYS_INVALID_INPUT_PARAM,
+                           boost::format("%s - %s must be invoked on the server hosting [%s]")
+                           % ctx.policy_name
+                           % retention_mode::trim_by_capacity
+                           % source_resource);
+            }
 
-        // gather remaining leaves
-        string_vector tmp{};
-        for(auto&& rl : roots_and_leaves) {
-            tmp.push_back(std::get<1>(rl));
+            vault_path          = pe::get_vault_path(source_resource);
+            percent_used_before = pe::get_filesystem_percent_used(vault_path, false);
+            percent_used        = percent_used_before;
+        }
+        catch(const irods::exception& e) {
+            return ERROR(e.code(), e.client_display_what());
         }
 
-        // if identical to original list then we unlink, not trim
-        auto unlink = (leaf_resources == tmp);
+        const auto dry_run = dry_run_enabled(ctx);
 
-        return std::make_tuple(unlink, tmp);
+        removal_counts totals{};
+        uint32_t skipped{}, batches{};
 
-    } // determine_resource_list_for_unlink
+        const auto preservation_set = get_preservation_set(ctx, comm, attribute);
+        const auto can_be_trimmed   = object_can_be_trimmed(preservation_set, source_resource, whitelist);
 
-    auto object_can_be_trimmed(
-        rsComm_t*            comm
-      , const std::string&   attribute
-      , const std::string&   source_resource
-      , const string_vector& whitelist)
-    {
-        if(!whitelist.empty()) {
-            if(std::find(whitelist.begin(), whitelist.end(), source_resource) == whitelist.end()) {
-                return false;
+        if(!can_be_trimmed) {
+            rodsLog(LOG_NOTICE,
+                    "irods_policy_data_retention - resource [%s] is preserved or not within the white list",
+                    source_resource.c_str());
+        }
+
+        if(can_be_trimmed && percent_used >= high_watermark) {
+            const auto qstr = fmt::format(
+                              "SELECT ORDER(META_DATA_ATTR_VALUE), COLL_NAME, DATA_NAME WHERE META_DATA_ATTR_NAME = '{}' AND DATA_REPL_STATUS = '1' AND RESC_ID IN ({})"
+                              , access_time_attribute
+                              , pe::compute_leaf_bundle(source_resource));
+
+            // candidates which were not trimmed remain at the head of the results, as does
+            // a replica whose trim succeeded without removing it from the catalog
+            uint32_t offset{};
+            std::set<std::string> attempted{};
+
+            while(percent_used >= low_watermark) {
+                irods::query<rsComm_t> qobj{comm, qstr, batch_size, offset, irods::query<rsComm_t>::GENERAL};
+
+                string_vector candidates{};
+                for(const auto& row : qobj) {
+                    candidates.push_back((fs::path{row[1]} / fs::path{row[2]}).string());
+                }
+
+                if(candidates.empty()) {
+                    break;
+                }
+
+                ++batches;
+
+                const auto objects = get_bulk_replica_facts(comm, candidates, batch_size);
+
+                removals_by_owner_type removals_by_owner{};
+                for(const auto& lp : candidates) {
+                    const auto itr = objects.find(lp);
+
+                    const replica_fact* replica{};
+                    bool elsewhere{};
+
+                    if(itr != objects.end()) {
+                        for(const auto& f : itr->second.facts) {
+                            irods::hierarchy_parser p(f.hierarchy);
+                            if(p.resc_in_hier(source_resource)) {
+                                replica = replica ? replica : &f;
+                            }
+                            else if(f.status == "1") {
+                                elsewhere = true;
+                            }
+                        }
+                    }
+
+                    // the last good replica of an object is never trimmed
+                    if(!replica || !elsewhere || !attempted.insert(lp).second) {
+                        ++skipped;
+                        ++offset;
+                        continue;
+                    }
+
+                    removals_by_owner[itr->second.owner].push_back(
+                        {lp, DATA_OBJ_TRIM_AN, replica->replica_number, replica->resource, replica->size});
+                }
+
+                // the usage does not change during a dry run, a single batch is planned
+                if(dry_run) {
+                    const auto counts = count_planned_removals(removals_by_owner);
+                    totals.trimmed         += counts.trimmed;
+                    totals.bytes_reclaimed += counts.bytes_reclaimed;
+                    break;
+                }
+
+                const auto counts = remove_replicas_by_owner(ctx, removals_by_owner, number_of_threads, false);
+
+                totals.trimmed         += counts.trimmed;
+                totals.failed          += counts.failed;
+                totals.bytes_reclaimed += counts.bytes_reclaimed;
+                totals.error_code       = counts.failed > 0 ? counts.error_code : totals.error_code;
+
+                offset += counts.failed;
+
+                // a batch whose trims all fail or have no effect will not lower the usage
+                if(!removals_by_owner.empty() && 0 == counts.trimmed) {
+                    rodsLog(LOG_NOTICE,
+                            "irods_policy_data_retention - no replicas trimmed from [%s], stopping at [%f] percent used",
+                            source_resource.c_str(),
+                            percent_used);
+                    break;
+                }
+
+                try {
+                    percent_used = pe::get_filesystem_percent_used(vault_path, false);
+                }
+                catch(const irods::exception& e) {
+                    return ERROR(e.code(), e.client_display_what());
+                }
             }
         }
 
-        return !resource_has_preservation_metadata(comm, attribute, source_resource);
+        const json report{
+            {"dry_run",             dry_run},
+            {"resource",            source_resource},
+            {"percent_used_before", percent_used_before},
+            {"percent_used_after",  percent_used},
+            {"batches",             batches},
+            {"trimmed",             totals.trimmed},
+            {"skipped",             skipped},
+            {"failed",              totals.failed},
+            {"bytes_reclaimed",     totals.bytes_reclaimed}};
+
+        pe::client_message({{"0.message", fmt::format("{} trimming {} by capacity", ctx.policy_name, source_resource)},
+                            {"1.report", report.dump()}});
+
+        if(out) {
+            *out = report.dump();
+        }
 
-    } // object_can_be_trimmed
+        if(totals.failed > 0) {
+            return ERROR(
+                       totals.error_code,
+                       boost::format("%s - failed to trim %d replicas from [%s]")
+                       % ctx.policy_name
+                       % totals.failed
+                       % source_resource);
+        }
+
+        return SUCCESS();
+
+    } // capacity_retention
+
+    auto report_planned_removals(const pe::context& ctx, pe::arg_type out, const json& planned) -> irods::error
+    {
+        const json report{{"dry_run", true}, {"planned", planned}};
+
+        pe::client_message({{"0.message", fmt::format("{} dry run", ctx.policy_name)},
+                            {"1.report", report.dump()}});
+
+        if(out) {
+            *out = report.dump();
+        }
+
+        return SUCCESS();
+
+    } // report_planned_removals
 
     auto data_retention_policy(const pe::context& ctx, pe::arg_type out)
     {
+        // metadata on a resource may add or remove the preservation attribute, there is no
+        // data object to act upon
+        if(is_resource_metadata_event(ctx)) {
+            get_preservation_cache(ctx).clear();
+            return SUCCESS();
+        }
+
         auto mode = pc::get(ctx.configuration, "mode", std::string{});
 
         if(!mode_is_supported(mode)) {
@@ -310,14 +773,29 @@ namespace {
         auto whitelist = pc::get(ctx.configuration, "resource_white_list", json::array());
         auto attribute = pc::get(ctx.configuration, kw::attribute, std::string{"irods::retention::preserve_replicas"});
 
+        if(mode == retention_mode::trim_by_capacity) {
+            return capacity_retention(ctx, out, source_resource, whitelist, attribute);
+        }
+
+        if(ctx.parameters.contains("logical_paths")) {
+            return bulk_retention(ctx, out, mode, source_resource, destination_resource, whitelist, attribute);
+        }
+
+        // every catalog fact is gathered up front, the decisions below are made in memory
+        const auto facts            = get_replica_facts(comm, logical_path);
+        const auto preservation_set = get_preservation_set(ctx, comm, attribute);
+
+        // a dry run reports each removal in place of issuing it
+        const auto dry_run = dry_run_enabled(ctx);
+        auto planned       = json::array();
+
         if(mode == retention_mode::remove_all) {
             pe::client_message({{"0.message", fmt::format("{} mode is removing all replicas", ctx.policy_name)}});
 
-            auto [unlink, resources_to_remove] =
-            determine_resource_list_for_unlink(
-                  comm
-                , attribute
-                , logical_path
+            auto [unlink, replicas_to_remove] =
+            determine_replicas_for_unlink(
+                  facts
+                , preservation_set
                 , whitelist);
 
             pe::client_message({{"0.message", fmt::format("{} unlink flag is {}", ctx.policy_name, unlink)}});
@@ -326,6 +804,18 @@ namespace {
             if(unlink) {
                 pe::client_message({{"0.message", fmt::format("{} removing data object {}", ctx.policy_name, unlink, logical_path)}});
 
+                string_vector resources_to_remove{};
+                for(auto&& r : replicas_to_remove) {
+                    resources_to_remove.push_back(r.resource);
+                }
+
+                if(dry_run) {
+                    planned.push_back({{"operation", "unlink"}, {"logical_path", logical_path}});
+                    return report_planned_removals(ctx, out, planned);
+                }
+
+                pe::apply_throttle(ctx.policy_name, ctx.configuration, resources_to_remove);
+
                 const auto ret = remove_data_object(
                                        DATA_OBJ_UNLINK_AN
                                      , comm
@@ -342,47 +832,66 @@ namespace {
             }
             // trim a specific list of replicas determined by policy
             else {
-                for(const auto& src : resources_to_remove) {
-                    pe::client_message({{"0.message", fmt::format("{} trimming replica {} from {}", ctx.policy_name, unlink, logical_path, src)}});
+                for(const auto& r : replicas_to_remove) {
+                    pe::client_message({{"0.message", fmt::format("{} trimming replica {} from {}", ctx.policy_name, unlink, logical_path, r.resource)}});
+
+                    if(dry_run) {
+                        planned.push_back({{"operation", "trim"}, {"logical_path", logical_path}, {"resource", r.resource}});
+                        continue;
+                    }
+
+                    pe::apply_throttle(ctx.policy_name, ctx.configuration, {r.resource});
 
                     const auto ret = remove_data_object(
                                            DATA_OBJ_TRIM_AN
                                          , comm
                                          , user_name
                                          , logical_path
-                                         , src);
+                                         , r.replica_number);
                     if(ret < 0) {
                          return ERROR(
                                    ret,
                                    boost::format("failed to remove [%s] from [%s]")
                                    % logical_path
-                                   % src);
+                                   % r.resource);
                     }
-                } // for src
+                } // for r
             }
         }
         // trim single replica
         else {
             if(source_resource.empty()) {
-                source_resource = get_source_resource(comm, logical_path, destination_resource);
+                source_resource = get_source_resource(facts, logical_path, destination_resource);
             }
 
             pe::client_message({{"0.message", fmt::format("{} mode is trimming single replica from {}", ctx.policy_name, source_resource)}});
 
-            if(object_can_be_trimmed(comm, attribute, source_resource, whitelist)) {
+            if(object_can_be_trimmed(preservation_set, source_resource, whitelist)) {
 
-                auto leaf_name = std::string{};
+                const auto replica = get_replica_for_root(facts, source_resource);
+                if(!replica) {
+                     return ERROR(
+                               SYS_REPLICA_DOES_NOT_EXIST,
+                               boost::format("no replica of [%s] found on [%s]")
+                               % logical_path
+                               % source_resource);
+                }
+
+                pe::client_message({{"0.message", fmt::format("{} trimming single replica {} from {}", ctx.policy_name, logical_path, replica->resource)}});
 
-                leaf_name = get_leaf_resource_for_root(comm, source_resource, logical_path);
+                if(dry_run) {
+                    planned.push_back({{"operation", "trim"}, {"logical_path", logical_path}, {"resource", replica->resource}});
+                    return report_planned_removals(ctx, out, planned);
+                }
 
-                pe::client_message({{"0.message", fmt::format("{} trimming single replica {} from {}", ctx.policy_name, logical_path, leaf_name)}});
+                pe::apply_throttle(ctx.policy_name, ctx.configuration, {source_resource, replica->resource});
 
                 const auto ret = remove_data_object(
                                        DATA_OBJ_TRIM_AN
                                      , comm
                                      , user_name
                                      , logical_path
-                                     , leaf_name);
+                                     , replica->replica_number);
                 if(ret < 0) {
                      return ERROR(
                                ret,
@@ -393,6 +902,10 @@ namespace {
             }
         }
 
+        if(dry_run) {
+            return report_planned_removals(ctx, out, planned);
+        }
+
         return SUCCESS();
 
     } // data_retention_policy
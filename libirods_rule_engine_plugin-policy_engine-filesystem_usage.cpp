@@ -4,10 +4,8 @@
 #include <irods/policy_composition_framework_configuration_manager.hpp>
 
 #include <irods/rsModAVUMetadata.hpp>
-#include <irods/irods_resource_backport.hpp>
 
-#include <sys/statvfs.h>
-#include <boost/filesystem.hpp>
+#include "vault_usage.hpp"
 
 namespace {
 
@@ -17,62 +15,24 @@ namespace {
     using     json = nlohmann::json;
     // clang-format on
 
-    auto get_vault_path(const std::string& name) -> std::string
-    {
-        rodsLong_t resc_id=0;
-        auto err = resc_mgr.hier_to_leaf_id(name, resc_id);
-        if(!err.ok()) {
-            THROW(err.code(), err.result());
-        }
-
-        std::string vp{};
-
-        err = irods::get_resource_property<std::string>(resc_id, irods::RESOURCE_PATH, vp);
-        if(!err.ok()) {
-            THROW(err.code(), err.result());
-        }
-
-        return vp;
-
-    } // get_vault_path
-
     irods::error filesystem_usage(const pe::context& ctx, pe::arg_type out)
     {
         auto [un, lp, source_resource, dr] = capture_parameters(ctx.parameters, tag_first_resc);
 
-        auto vault_path = get_vault_path(source_resource);
+        auto vault_path = pe::get_vault_path(source_resource);
 
         pe::client_message({{"0.usage", fmt::format("{} requires source_resource", ctx.policy_name)},
                             {"1.vault_path", vault_path}});
 
-        boost::filesystem::path path_to_stat{vault_path};
-        while(!boost::filesystem::exists(path_to_stat)) {
-            rodsLog(LOG_NOTICE, "[%s]: path to stat [%s] doesn't exist, moving to parent", __FUNCTION__, path_to_stat.string().c_str());
-            path_to_stat = path_to_stat.parent_path();
-            if (path_to_stat.empty()) {
-                auto msg = fmt::format("[{}]: could not find existing path from given path path [{}]"
-                           , __FUNCTION__
-                           , vault_path.c_str());
-                rodsLog(LOG_ERROR, msg.c_str());
-                return ERROR(SYS_INVALID_RESC_INPUT, msg);
-            }
+        double percent_used{};
+        try {
+            percent_used = pe::get_filesystem_percent_used(vault_path);
         }
-
-        struct statvfs statvfs_buf;
-        const int statvfs_ret = statvfs(path_to_stat.string().c_str(), &statvfs_buf);
-        if (statvfs_ret != 0) {
-            auto msg = fmt::format("[{}]: statvfs() of [{}] failed with return {} and errno {}"
-                       , __FUNCTION__
-                       , path_to_stat.string()
-                       , statvfs_ret
-                       , errno);
-            return ERROR(SYS_INVALID_RESC_INPUT, msg);
+        catch(const irods::exception& e) {
+            rodsLog(LOG_ERROR, "%s", e.client_display_what());
+            return ERROR(e.code(), e.client_display_what());
         }
 
-        uint64_t free_space_blocks  = static_cast<uint64_t>(statvfs_buf.f_bavail);
-        uint64_t total_space_blocks = static_cast<uint64_t>(statvfs_buf.f_blocks);
-
-        double percent_used = 100.0 * (1.0 - static_cast<double>(free_space_blocks) / static_cast<double>(total_space_blocks));
         std::string percent_used_str = std::to_string(percent_used);
 
         modAVUMetadataInp_t set_op{};
@@ -5,11 +5,26 @@
 
 #include <irods/thread_pool.hpp>
 #include <irods/query_processor.hpp>
+#include <irods/irods_at_scope_exit.hpp>
+#include <irods/irods_server_properties.hpp>
 
 #include <nlohmann/json.hpp>
 #include <fmt/format.h>
 
+#include <atomic>
+#include <chrono>
+#include <thread>
+#include <functional>
+#include <future>
+#include <list>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <optional>
+
 #include "parameter_substitution.hpp"
+#include "plugin_configuration.hpp"
+#include "query_processor_utilities.hpp"
 
 namespace {
 
@@ -39,16 +54,26 @@ namespace {
             const auto& params = ctx.parameters;
 
             // clang-format off
-            auto number_of_threads  = pc::get(params, "number_of_threads",  4);
-            auto query_limit        = pc::get(params, "query_limit",        uint32_t{0});
-            auto query_type_string  = pc::get(params, "query_type",         std::string{"general"});
-            auto query_string       = pc::get(params, "query_string",       std::string{});
-            auto policies_to_invoke = pc::get(params, "policies_to_invoke", json{});
-            auto stop_on_error      = pc::get(params, "stop_on_error",      std::string{}) == "true";
+            auto threads_parameter   = pc::get(params, "number_of_threads",   json(4));
+            auto query_limit         = pc::get(params, "query_limit",         uint32_t{0});
+            auto query_type_string   = pc::get(params, "query_type",          std::string{"general"});
+            auto query_string        = pc::get(params, "query_string",        std::string{});
+            auto policies_to_invoke  = pc::get(params, "policies_to_invoke",  json{});
+            auto stop_on_error       = pc::get(params, "stop_on_error",       std::string{}) == "true";
+            auto dry_run             = pc::get(params, "dry_run",             std::string{}) == "true";
+            auto dry_run_sample_size = pc::get(params, "dry_run_sample_size", uint32_t{0});
             // clang-format on
 
+            // number_of_threads may be "auto" in which case the effective number of
+            // workers is adjusted between the minimum and maximum at run time
+            auto adaptive_threads  = threads_parameter.is_string() && "auto" == threads_parameter.get<std::string>();
+            auto minimum_threads   = pc::get(params, "minimum_number_of_threads", uint32_t{1});
+            auto maximum_threads   = pc::get(params, "maximum_number_of_threads", uint32_t{16});
+            auto adjustment_window = pc::get(params, "thread_adjustment_window",  uint32_t{16});
+            auto number_of_threads = adaptive_threads ? maximum_threads : threads_parameter.get<uint32_t>();
+
             pe::client_message({{"0.usage", fmt::format("{} requires query_string", ctx.policy_name)},
-                                {"1.number_of_threads", number_of_threads},
+                                {"1.number_of_threads", threads_parameter},
                                 {"2.query_limit", query_limit},
                                 {"3.query_type", query_type_string},
                                 {"4.query_string", query_string},
@@ -59,7 +84,16 @@ namespace {
                 return ERROR(SYS_INVALID_INPUT_PARAM, "irods_policy_query_processor - empty query string");
             }
 
-            if(policies_to_invoke.empty()) {
+            // a sink writes each row to a local file rather than invoking policies.  local
+            // files are confined to the report_directory of the plugin_specific_configuration
+            // as they are written by the service account
+            const auto sink_parameters  = pc::get(params, "sink", json{});
+            const auto report_directory = pc::get(
+                                              pe::read_plugin_specific_configuration(ctx.instance_name)
+                                            , "report_directory"
+                                            , std::string{});
+
+            if(policies_to_invoke.empty() && sink_parameters.empty()) {
                 return ERROR(SYS_INVALID_INPUT_PARAM, "irods_policy_query_processor - empty policies_to_invoke");
             }
 
@@ -76,7 +110,29 @@ namespace {
 
             auto [data_name, coll_name] = pe::split_logical_path(comm, logical_path);
 
-            std::vector<std::string> values = {std::to_string(std::time(nullptr)), "0", user_name, coll_name, data_name, source_resource, destination_resource};
+            // an incremental query stores a watermark after each successful run which is
+            // substituted for IRODS_TOKEN_LAST_RUN_TIME_END_TOKEN by the next run
+            const auto run_start_time = std::time(nullptr);
+            const auto watermark_name = pc::get(params, "watermark_name", std::string{});
+            const auto watermark_collection = pc::get(
+                                                  params
+                                                , "watermark_collection"
+                                                , "/" + irods::get_server_property<std::string>(irods::KW_CFG_ZONE_NAME));
+
+            // rows are returned in no particular order, so a limited run may advance the
+            // watermark past rows which were never returned and would never be seen again
+            if(!watermark_name.empty() && query_limit > 0) {
+                return ERROR(
+                           SYS_INVALID_INPUT_PARAM,
+                           boost::format("irods_policy_query_processor - query_limit may not be used with watermark [%s]")
+                           % watermark_name);
+            }
+
+            const auto last_run_time = watermark_name.empty()
+                                       ? std::string{"0"}
+                                       : irods::get_watermark(comm, watermark_collection, watermark_name);
+
+            std::vector<std::string> values = {std::to_string(run_start_time), "0", user_name, coll_name, data_name, source_resource, destination_resource, last_run_time};
 
             time_t lifetime{};
             if(ctx.parameters.contains("lifetime")) {
@@ -97,6 +153,19 @@ namespace {
 
             pe::client_message({{"0.message", fmt::format("{} query_string {}", ctx.policy_name, query_string)}});
 
+            // the watermark advances to the greatest value of the watermark column seen by
+            // this run, or to the start time of this run if no column is configured
+            std::optional<uint32_t> watermark_index{};
+            if(!watermark_name.empty() && params.contains("watermark_column")) {
+                const auto& column = params.at("watermark_column");
+                watermark_index = column.is_string()
+                                  ? irods::get_column_index(query_string, column.get<std::string>())
+                                  : column.get<uint32_t>();
+            }
+
+            irods::watermark_tracker watermark{};
+            std::atomic<uint32_t>    failed_rows{};
+
             using json       = nlohmann::json;
             using result_row = irods::query_processor<rsComm_t>::result_row;
 
@@ -110,7 +179,127 @@ namespace {
 
             pe::client_message({{"0.message", fmt::format("{} params_to_pass {}", ctx.policy_name, params_to_pass.dump(4))}});
 
-            auto job = [&](const result_row& _results) {
+            // optionally collapse rows sharing the values of the dedupe_on columns, such as
+            // the rows for each replica of a data object, into a single invocation
+            const auto dedupe_columns = pc::get(params, "dedupe_on", std::vector<uint32_t>{});
+            const auto group_rows     = !dedupe_columns.empty() && pc::get(params, "group_rows", std::string{}) == "true";
+
+            std::unique_ptr<irods::row_deduplicator> deduplicator{};
+            if(!dedupe_columns.empty()) {
+                deduplicator = std::make_unique<irods::row_deduplicator>(dedupe_columns, group_rows);
+            }
+
+            // failed policy invocations are retried once the scan completes, those beyond
+            // the size of the queue or which fail every attempt are written to the report
+            const auto retry_attempts    = pc::get(params, "retry_attempts",    uint32_t{0});
+            const auto retry_backoff_ms  = pc::get(params, "retry_backoff_ms",  uint32_t{1000});
+            const auto retry_backoff_max = pc::get(params, "retry_backoff_max_ms", uint32_t{60000});
+            const auto retry_queue_size  = pc::get(params, "retry_queue_size",  uint32_t{10000});
+            const auto error_report_file = params.contains("error_report_file")
+                                           ? irods::resolve_local_path(report_directory, params.at("error_report_file").get<std::string>())
+                                           : std::string{};
+
+            std::mutex                      failures_mutex{};
+            std::vector<irods::row_failure> failures{};
+            uint32_t                        unqueued_failures{};
+
+            auto record_failure = [&](
+                  const result_row&  _results
+                , uint32_t           _policy_index
+                , const json&        _injected
+                , const std::string& _out) {
+                // failures are only held for a retry or a report
+                if(0 == retry_attempts && error_report_file.empty()) {
+                    return;
+                }
+
+                irods::row_failure f{
+                      _results
+                    , _policy_index
+                    , policies_to_invoke.at(_policy_index).at(kw::policy_to_invoke).get<std::string>()
+                    , SYS_INVALID_OPR_TYPE
+                    , _out
+                    , _injected.dump()};
+
+                const auto j = json::parse(_out, nullptr, false);
+                if(j.is_object() && j.contains("code") && j.at("code").is_number_integer()) {
+                    f.code = j.at("code").get<int>();
+                }
+
+                std::lock_guard lk{failures_mutex};
+                if(failures.size() < retry_queue_size) {
+                    failures.push_back(std::move(f));
+                    return;
+                }
+
+                ++unqueued_failures;
+                if(!error_report_file.empty()) {
+                    irods::write_error_report(error_report_file, {f});
+                }
+            }; // record_failure
+
+            // invokes a single policy for a row of results, returning its output.  injected
+            // parameters such as grouped_query_results or policy_outputs are added as given
+            auto invoke_policy_for_row = [&](
+                  const json& _policy
+                , const json& _results
+                , const json& _injected) -> std::string {
+
+                json pam{}, cfg{};
+
+                if(_policy.contains(kw::parameters)) {
+                    pam = _policy.at(kw::parameters);
+                    pam.insert(params_to_pass.begin(), params_to_pass.end());
+                }
+                else {
+                    pam = params_to_pass;
+                }
+
+                if(_policy.contains(kw::configuration)) {
+                    cfg = _policy.at(kw::configuration);
+                }
+                else if(ctx.parameters.contains(kw::configuration)) {
+                   cfg = ctx.parameters.at(kw::configuration);
+                }
+
+                // inject query results into parameters
+                pam["query_results"] = _results;
+
+                if(_injected.is_object()) {
+                    for(const auto& [k, v] : _injected.items()) {
+                        pam[k] = v;
+                    }
+                }
+
+                auto pnm = _policy.at(kw::policy_to_invoke).get<std::string>();
+
+                std::string params{pam.dump()};
+                std::string config{cfg.dump()};
+                std::string out{};
+
+                std::list<boost::any> args;
+                args.push_back(boost::any(&params));
+                args.push_back(boost::any(&config));
+                args.push_back(boost::any(&out));
+
+                pc::invoke_policy(ctx.rei, pnm, args);
+
+                return out;
+
+            }; // invoke_policy_for_row
+
+            // policies may be given a name and a list of the names of the policies on which
+            // they depend, whose outputs are passed to them as policy_outputs.  policies are
+            // invoked in levels, those within a level being independent of one another
+            const auto policy_levels = irods::compute_policy_levels(policies_to_invoke);
+            const auto chained       = std::any_of(
+                                           policies_to_invoke.begin()
+                                         , policies_to_invoke.end()
+                                         , [](const json& _p) { return _p.contains("depends_on"); });
+
+            auto process_row = [&](const result_row& _results) -> bool {
+
+                auto failed = false;
 
                 // capture the row of results from the query
                 auto res_arr = json::array();
@@ -119,59 +308,420 @@ namespace {
                     res_arr.push_back(r);
                 }
 
-                std::list<boost::any> args;
+                auto injected = json::object();
+                if(group_rows) {
+                    injected["grouped_query_results"] = deduplicator->group(_results);
+                }
+
+                if(!chained) {
+                    for(uint32_t i = 0; i < policies_to_invoke.size(); ++i) {
+
+                        auto out = invoke_policy_for_row(policies_to_invoke[i], res_arr, injected);
+
+                        if(out.size() > 0 && pc::contains_error(out)) {
+                            failed = true;
+
+                            record_failure(_results, i, injected, out);
+
+                            if(stop_on_error) {
+                                freeRErrorContent(&ctx.rei->rsComm->rError);
+                                break;
+                            }
+                        }
+
+                    } // for policy
+
+                    return !failed;
+                }
 
-                for(auto policy : policies_to_invoke) {
+                // not std::vector<bool>, elements are written concurrently within a level
+                std::vector<std::string> outputs(policies_to_invoke.size());
+                std::vector<uint8_t>     succeeded(policies_to_invoke.size(), 0);
 
-                    json pam{}, cfg{};
+                auto invoke_chained = [&](uint32_t _index) {
+                    const auto& policy = policies_to_invoke[_index];
 
-                    if(policy.contains(kw::parameters)) {
-                        pam = policy.at(kw::parameters);
-                        pam.insert(params_to_pass.begin(), params_to_pass.end());
+                    auto policy_injected = injected;
+                    auto policy_outputs  = json::object();
+                    for(const auto& d : irods::get_policy_dependencies(policies_to_invoke, _index)) {
+                        // a policy is skipped if any policy on which it depends failed
+                        if(!succeeded[d]) {
+                            return;
+                        }
+
+                        const auto j = json::parse(outputs[d], nullptr, false);
+                        policy_outputs[irods::get_policy_name(policies_to_invoke, d)] = j.is_discarded() ? json(outputs[d]) : j;
+                    }
+
+                    policy_injected["policy_outputs"] = policy_outputs;
+
+                    outputs[_index]   = invoke_policy_for_row(policy, res_arr, policy_injected);
+                    succeeded[_index] = outputs[_index].empty() || !pc::contains_error(outputs[_index]);
+                };
+
+                for(const auto& level : policy_levels) {
+                    if(1 == level.size()) {
+                        invoke_chained(level.front());
                     }
                     else {
-                        pam = params_to_pass;
+                        std::vector<std::future<void>> pending{};
+                        for(const auto i : level) {
+                            pending.push_back(std::async(std::launch::async, invoke_chained, i));
+                        }
+
+                        for(auto& p : pending) {
+                            p.get();
+                        }
                     }
 
-                    if(policy.contains(kw::configuration)) {
-                        cfg = policy.at(kw::configuration);
+                    const auto level_failed = std::any_of(level.begin(), level.end(), [&succeeded](auto i) { return !succeeded[i]; });
+                    if(level_failed) {
+                        failed = true;
+
+                        if(stop_on_error) {
+                            freeRErrorContent(&ctx.rei->rsComm->rError);
+                            break;
+                        }
                     }
-                    else if(ctx.parameters.contains(kw::configuration)) {
-                       cfg = ctx.parameters.at(kw::configuration);
+                }
+
+                // a chain is retried as a whole, the first policy to fail is reported
+                if(failed) {
+                    for(const auto& level : policy_levels) {
+                        const auto it = std::find_if(level.begin(), level.end(), [&](auto i) {
+                            return !outputs[i].empty() && !succeeded[i]; });
+
+                        if(level.end() != it) {
+                            record_failure(_results, *it, injected, outputs[*it]);
+                            break;
+                        }
                     }
+                }
+
+                return !failed;
+
+            }; // process_row
+
+            if(dry_run) {
+                using clock = std::chrono::steady_clock;
+
+                const auto total_rows     = irods::count_query_rows(comm, query_string, query_type_string);
+                const auto projected_rows = query_limit > 0
+                                            ? std::min<uint64_t>(total_rows, query_limit)
+                                            : total_rows;
+
+                // the COUNT of a general query does not account for distinct rows
+                const auto estimated = irods::query<rsComm_t>::GENERAL ==
+                                       irods::query<rsComm_t>::convert_string_to_query_type(query_type_string);
+
+                json report{
+                      {"query_string",               query_string}
+                    , {"projected_rows",             projected_rows}
+                    , {"projected_rows_is_estimate", estimated}
+                    , {"number_of_threads",          number_of_threads}
+                    , {"sample_size",                0}};
+
+                // sampled policies receive "dry_run" : "true" within their parameters
+                if(dry_run_sample_size > 0) {
+                    std::map<std::string, std::vector<double>> latencies{};
+                    double   total_milliseconds{};
+                    uint32_t sampled_rows{};
+
+                    irods::query<rsComm_t> sample{
+                          &comm
+                        , query_string
+                        , dry_run_sample_size
+                        , 0
+                        , irods::query<rsComm_t>::convert_string_to_query_type(query_type_string)};
+
+                    for(const auto& row : sample) {
+                        auto res_arr = json::array();
+                        for(auto& r : row) {
+                            res_arr.push_back(r);
+                        }
+
+                        for(const auto& policy : policies_to_invoke) {
+                            const auto start = clock::now();
+                            invoke_policy_for_row(policy, res_arr, json{{"dry_run", "true"}});
+                            const auto ms = std::chrono::duration<double, std::milli>(clock::now() - start).count();
+
+                            latencies[policy.at(kw::policy_to_invoke).get<std::string>()].push_back(ms);
+                            total_milliseconds += ms;
+                        }
+
+                        ++sampled_rows;
+                    }
+
+                    // errors from the sampled invocations are not errors of the dry run
+                    freeRErrorContent(&ctx.rei->rsComm->rError);
 
-                    // inject query results into parameters
-                    pam["query_results"] = res_arr;
+                    auto per_policy = json::object();
+                    for(const auto& [name, samples] : latencies) {
+                        per_policy[name] = {
+                              {"p50_ms", irods::compute_percentile(samples, 50)}
+                            , {"p90_ms", irods::compute_percentile(samples, 90)}
+                            , {"p99_ms", irods::compute_percentile(samples, 99)}};
+                    }
 
-                    auto pnm = policy.at(kw::policy_to_invoke).get<std::string>();
+                    const auto mean_row_milliseconds = sampled_rows > 0 ? total_milliseconds / sampled_rows : 0.0;
 
-                    std::string params{pam.dump()};
-                    std::string config{cfg.dump()};
-                    std::string out{};
+                    report["sample_size"]                 = sampled_rows;
+                    report["policy_latency"]              = per_policy;
+                    report["estimated_wall_time_seconds"] =
+                        projected_rows * mean_row_milliseconds / 1000.0 / std::max(number_of_threads, 1u);
+                }
 
-                    args.clear();
-                    args.push_back(boost::any(&params));
-                    args.push_back(boost::any(&config));
-                    args.push_back(boost::any(&out));
+                pe::client_message({{"0.message", fmt::format("{} dry_run {}", ctx.policy_name, report.dump(4))}});
 
-                    pc::invoke_policy(ctx.rei, pnm, args);
+                if(out) {
+                    *out = report.dump();
+                }
 
-                    if(stop_on_error && out.size() > 0 && pc::contains_error(out)) {
-                        freeRErrorContent(&ctx.rei->rsComm->rError);
-                        break;
+                return SUCCESS();
+
+            } // dry_run
+
+            // the report holds the failures of the most recent run
+            if(!error_report_file.empty()) {
+                irods::create_error_report(error_report_file);
+            }
+
+            std::unique_ptr<irods::adaptive_concurrency> concurrency{};
+            if(adaptive_threads) {
+                concurrency = std::make_unique<irods::adaptive_concurrency>(
+                                  ctx.policy_name
+                                , minimum_threads
+                                , maximum_threads
+                                , adjustment_window);
+            }
+
+            auto job = [&](const result_row& _results) {
+                if(!concurrency) {
+                    if(!process_row(_results)) {
+                        ++failed_rows;
                     }
 
-                } // for policy
+                    return;
+                }
+
+                using clock = std::chrono::steady_clock;
+
+                concurrency->acquire();
+                const auto start   = clock::now();
+                const auto elapsed = [&start] {
+                    return std::chrono::duration_cast<std::chrono::microseconds>(clock::now() - start); };
+
+                try {
+                    const auto succeeded = process_row(_results);
+                    concurrency->release(elapsed(), !succeeded);
+                    if(!succeeded) {
+                        ++failed_rows;
+                    }
+                }
+                catch(...) {
+                    concurrency->release(elapsed(), true);
+                    throw;
+                }
 
             }; // job
 
             auto query_type = irods::query<rsComm_t>::convert_string_to_query_type(query_type_string);
 
-            auto tp     = irods::thread_pool{number_of_threads};
-            auto qp     = irods::query_processor<rsComm_t>{query_string, job, query_limit, query_type};
+            // optionally route rows through per-key queues, e.g. keyed by RESC_NAME, such
+            // that each key has a bounded number of rows in flight.  the query processor
+            // only enqueues rows while a separate set of workers drains the queues
+            std::mutex                                 worker_errors_mutex{};
+            std::vector<std::tuple<int, std::string>>  worker_errors{};
+            std::unique_ptr<irods::affinity_scheduler> scheduler{};
+            std::unique_ptr<irods::thread_pool>        workers{};
+
+            // rows not run by the query processor itself record their errors here
+            auto run_and_capture_errors = [&](const std::function<void()>& _fn) {
+                try {
+                    _fn();
+                }
+                catch(const irods::exception& e) {
+                    std::lock_guard lk{worker_errors_mutex};
+                    worker_errors.emplace_back(e.code(), e.client_display_what());
+                }
+                catch(const std::exception& e) {
+                    std::lock_guard lk{worker_errors_mutex};
+                    worker_errors.emplace_back(SYS_INTERNAL_ERR, e.what());
+                }
+            }; // run_and_capture_errors
+
+            irods::at_scope_exit close_scheduler{[&scheduler] {
+                if(scheduler) {
+                    scheduler->close();
+                }
+            }};
+
+            std::function<void(const result_row&)> row_handler = job;
+
+            std::unique_ptr<irods::row_sink> sink{};
+
+            std::string sink_path{};
+
+            if(!sink_parameters.empty()) {
+                sink_path = pc::get(sink_parameters, "path", std::string{});
+                if(sink_path.empty()) {
+                    return ERROR(SYS_INVALID_INPUT_PARAM, "irods_policy_query_processor - sink requires a path");
+                }
+
+                sink_path = irods::resolve_local_path(report_directory, sink_path);
+
+                sink = std::make_unique<irods::row_sink>(
+                           sink_path
+                         , pc::get(sink_parameters, "format",      std::string{"jsonl"})
+                         , pc::get(sink_parameters, "compression", std::string{"none"})
+                         , irods::query<rsComm_t>::GENERAL == query_type
+                           ? irods::parse_selected_columns(query_string)
+                           : std::vector<std::string>{}
+                         , pc::get(sink_parameters, "chunk_size",  uint32_t{1024 * 1024}));
+
+                row_handler = [&sink](const result_row& _results) {
+                    sink->write(_results);
+                };
+            }
+            else if(params.contains("affinity_column")) {
+                const auto& column = params.at("affinity_column");
+                const auto  index  = column.is_string()
+                                     ? irods::get_column_index(query_string, column.get<std::string>())
+                                     : column.get<uint32_t>();
+
+                scheduler = std::make_unique<irods::affinity_scheduler>(
+                                index
+                              , pc::get(params, "affinity_concurrency_limit", uint32_t{1})
+                              , pc::get(params, "affinity_buffer_size",       uint32_t{10000}));
+
+                workers = std::make_unique<irods::thread_pool>(number_of_threads);
+
+                for(uint32_t w = 0; w < number_of_threads; ++w) {
+                    irods::thread_pool::post(*workers, [&, w] {
+                        result_row  row{};
+                        std::string key{};
+                        while(scheduler->pop(w, row, key)) {
+                            run_and_capture_errors([&] { job(row); });
+                            scheduler->done(key);
+                        }
+                    });
+                }
+
+                row_handler = [&scheduler](const result_row& _results) {
+                    scheduler->push(_results);
+                };
+            }
+
+            // grouped rows are only dispatched once the scan has seen every member
+            const auto dispatch_row = row_handler;
+
+            if(deduplicator) {
+                row_handler = [&deduplicator, group_rows, dispatch_row](const result_row& _results) {
+                    if(deduplicator->insert(_results) && !group_rows) {
+                        dispatch_row(_results);
+                    }
+                };
+            }
+
+            if(watermark_index) {
+                row_handler = [&watermark, &watermark_index, next = row_handler](const result_row& _results) {
+                    if(*watermark_index < _results.size()) {
+                        watermark.observe(_results[*watermark_index]);
+                    }
+
+                    next(_results);
+                };
+            }
+
+            auto tp     = irods::thread_pool{scheduler ? 1 : number_of_threads};
+            auto qp     = irods::query_processor<rsComm_t>{query_string, row_handler, query_limit, query_type};
             auto f      = qp.execute(tp, *ctx.rei->rsComm);
             auto errors = f.get();
 
+            if(group_rows) {
+                for(auto& row : deduplicator->first_rows()) {
+                    irods::thread_pool::post(tp, [&, row] {
+                        run_and_capture_errors([&] { dispatch_row(row); });
+                    });
+                }
+
+                tp.join();
+            }
+
+            if(scheduler) {
+                scheduler->close();
+                workers->join();
+            }
+
+            if(sink) {
+                const auto rows_written = sink->close();
+
+                pe::client_message({{"0.message", fmt::format(
+                                                      "{} wrote [{}] rows to [{}]"
+                                                    , ctx.policy_name
+                                                    , rows_written
+                                                    , sink_path)}});
+            }
+
+            for(auto& e : worker_errors) {
+                errors.emplace_back(std::get<0>(e), std::get<1>(e));
+            }
+
+            // retry failed invocations with exponential backoff, only the policy which
+            // failed is invoked again for the row unless the policies form a chain
+            for(uint32_t attempt = 0; attempt < retry_attempts && !failures.empty(); ++attempt) {
+                // the exponent is bounded so the shift is defined, and the wait by the maximum
+                const auto backoff = std::min<uint64_t>(uint64_t{retry_backoff_ms} << std::min(attempt, 16u), retry_backoff_max);
+                std::this_thread::sleep_for(std::chrono::milliseconds{backoff});
+
+                rodsLog(
+                    LOG_NOTICE,
+                    "%s :: retry attempt [%u] of [%u] for [%lu] failed invocations",
+                    ctx.policy_name.c_str(),
+                    attempt + 1,
+                    retry_attempts,
+                    failures.size());
+
+                std::vector<irods::row_failure> retrying{};
+                retrying.swap(failures);
+
+                irods::thread_pool retry_pool{std::min<uint32_t>(number_of_threads, retrying.size())};
+                for(auto& f : retrying) {
+                    irods::thread_pool::post(retry_pool, [&] {
+                        if(chained) {
+                            process_row(f.row);
+                            return;
+                        }
+
+                        auto injected = json::parse(f.injected_parameters);
+                        auto out      = invoke_policy_for_row(policies_to_invoke.at(f.policy_index), json(f.row), injected);
+
+                        if(out.size() > 0 && pc::contains_error(out)) {
+                            record_failure(f.row, f.policy_index, injected, out);
+                        }
+                    });
+                }
+
+                retry_pool.join();
+            }
+
+            if(retry_attempts > 0 || !error_report_file.empty()) {
+                failed_rows = failures.size() + unqueued_failures;
+
+                if(!failures.empty() && !error_report_file.empty()) {
+                    irods::write_error_report(error_report_file, failures);
+                }
+
+                if(failed_rows > 0) {
+                    rodsLog(
+                        LOG_ERROR,
+                        "%s :: [%u] policy invocations failed, report [%s]",
+                        ctx.policy_name.c_str(),
+                        failed_rows.load(),
+                        error_report_file.c_str());
+                }
+            }
+
             if(errors.size() > 0) {
                 for(auto& e : errors) {
                     rodsLog(
@@ -204,6 +754,35 @@ namespace {
                     job(res);
                 }
             }
+
+            if(!watermark_name.empty()) {
+                if(failed_rows > 0) {
+                    rodsLog(
+                        LOG_NOTICE,
+                        "%s :: [%u] rows failed, watermark [%s] remains [%s]",
+                        ctx.policy_name.c_str(),
+                        failed_rows.load(),
+                        watermark_name.c_str(),
+                        last_run_time.c_str());
+                }
+                else {
+                    auto next = watermark_index
+                                ? watermark.value()
+                                : fmt::format("{:011}", run_start_time);
+
+                    if(!next.empty()) {
+                        const auto ret = irods::set_watermark(comm, watermark_collection, watermark_name, next);
+                        if(ret < 0) {
+                            return ERROR(
+                                       ret,
+                                       boost::format("failed to store watermark [%s] value [%s] on [%s]")
+                                       % watermark_name
+                                       % next
+                                       % watermark_collection);
+                        }
+                    }
+                }
+            }
         }
         catch(const irods::exception& e) {
             if(CAT_NO_ROWS_FOUND == e.code()) {
@@ -7,6 +7,7 @@
 #include <irods/rsFileChksum.hpp>
 
 #include "data_verification_utilities.hpp"
+#include "throttle.hpp"
 
 namespace {
 
@@ -81,6 +82,22 @@ namespace {
         rstrcpy(inp.rescHier,      resc_hier.c_str(),     MAX_NAME_LEN);
         rstrcpy(inp.objPath,       logical_path.c_str(),  MAX_NAME_LEN);
 
+        // a dry run of the query processor resolves the replica without reading it
+        if(pc::get(ctx.parameters, "dry_run", std::string{}) == "true") {
+            pe::client_message({{"0.message", fmt::format("{} dry_run, {} is not read", ctx.policy_name, phys_path)}});
+
+            if(out) {
+                *out = json{{"dry_run",          true},
+                            {"logical_path",     logical_path},
+                            {"source_resource",  source_resource},
+                            {"catalog_checksum", catalog_checksum}}.dump();
+            }
+
+            return SUCCESS();
+        }
+
+        pe::apply_throttle(ctx.policy_name, ctx.configuration, {source_resource}, inp.dataSize);
+
         char* computed_checksum{};
         if(const auto ec = rsFileChksum(comm, &inp, &computed_checksum); ec < 0) {
             return ERROR(ec, fmt::format("{} :: rsFileChksum failed for {} on {}"
@@ -106,6 +123,14 @@ namespace {
             return ERROR(USER_CHKSUM_MISMATCH, msg);
         }
 
+        // the checksum is made available to policies chained after this one
+        if(out) {
+            *out = json{{"logical_path",     logical_path},
+                        {"source_resource",  source_resource},
+                        {"checksum",         computed_checksum},
+                        {"catalog_checksum", catalog_checksum}}.dump();
+        }
+
         return SUCCESS();
 
     } // verify_checksum
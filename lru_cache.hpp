@@ -0,0 +1,106 @@
+#ifndef IRODS_POLICY_ENGINE_LRU_CACHE_HPP
+#define IRODS_POLICY_ENGINE_LRU_CACHE_HPP
+
+#include <algorithm>
+#include <chrono>
+#include <cstddef>
+#include <list>
+#include <mutex>
+#include <optional>
+#include <unordered_map>
+
+namespace irods::policy_composition::policy_engine {
+
+    // a thread safe map holding at most a fixed number of entries, the least recently
+    // used entry is evicted to make room for a new one.  entries older than the time to
+    // live, if one is given, are treated as missing.  instances are typically static and
+    // therefore shared by every invocation of a policy within an agent
+    template <typename Key, typename Value>
+    class lru_cache {
+    public:
+        explicit lru_cache(std::size_t _capacity, std::chrono::seconds _time_to_live = std::chrono::seconds{0})
+            : capacity_{std::max<std::size_t>(_capacity, 1)}
+            , time_to_live_{_time_to_live}
+        {
+        }
+
+        auto get(const Key& _key) -> std::optional<Value>
+        {
+            std::lock_guard lk{mutex_};
+
+            auto it = index_.find(_key);
+            if(index_.end() == it) {
+                return std::nullopt;
+            }
+
+            if(time_to_live_.count() > 0 && clock::now() - it->second->stored > time_to_live_) {
+                entries_.erase(it->second);
+                index_.erase(it);
+                return std::nullopt;
+            }
+
+            entries_.splice(entries_.begin(), entries_, it->second);
+
+            return it->second->value;
+        } // get
+
+        void put(const Key& _key, const Value& _value)
+        {
+            std::lock_guard lk{mutex_};
+
+            if(auto it = index_.find(_key); index_.end() != it) {
+                it->second->value  = _value;
+                it->second->stored = clock::now();
+                entries_.splice(entries_.begin(), entries_, it->second);
+                return;
+            }
+
+            if(entries_.size() >= capacity_) {
+                index_.erase(entries_.back().key);
+                entries_.pop_back();
+            }
+
+            entries_.push_front(entry{_key, _value, clock::now()});
+            index_[_key] = entries_.begin();
+        } // put
+
+        void erase(const Key& _key)
+        {
+            std::lock_guard lk{mutex_};
+
+            if(auto it = index_.find(_key); index_.end() != it) {
+                entries_.erase(it->second);
+                index_.erase(it);
+            }
+        } // erase
+
+        void clear()
+        {
+            std::lock_guard lk{mutex_};
+            entries_.clear();
+            index_.clear();
+        } // clear
+
+    private:
+        using clock = std::chrono::steady_clock;
+
+        struct entry {
+            Key               key;
+            Value             value;
+            clock::time_point stored;
+        };
+
+        using entry_list = std::list<entry>;
+
+        const std::size_t          capacity_;
+        const std::chrono::seconds time_to_live_;
+
+        std::mutex                                             mutex_;
+        entry_list                                             entries_;
+        std::unordered_map<Key, typename entry_list::iterator> index_;
+
+    }; // class lru_cache
+
+} // namespace irods::policy_composition::policy_engine
+
+#endif // IRODS_POLICY_ENGINE_LRU_CACHE_HPP
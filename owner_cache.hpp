@@ -0,0 +1,116 @@
+#ifndef IRODS_POLICY_ENGINE_OWNER_CACHE_HPP
+#define IRODS_POLICY_ENGINE_OWNER_CACHE_HPP
+
+#include <irods/irods_query.hpp>
+#include <irods/filesystem.hpp>
+
+#include <nlohmann/json.hpp>
+#include <fmt/format.h>
+
+#include <chrono>
+#include <string>
+
+#include "lru_cache.hpp"
+
+// Caches the owner of data objects and collections for the policies which act as the
+// owner of an object, sparing a catalog query for each invocation.  Entries expire after
+// a time to live as a change of ownership made by another agent is not observed, and
+// are invalidated by the policy when it is invoked for a RENAME or UNLINK event.
+
+namespace irods::policy_composition::policy_engine {
+
+    namespace owner_cache_keywords {
+        static const std::string owner_cache_size{"owner_cache_size"};
+        static const std::string owner_cache_ttl_seconds{"owner_cache_ttl_seconds"};
+    } // owner_cache_keywords
+
+    // the cache is created on first use with the size and time to live then configured,
+    // callers pass the plugin_specific_configuration so that no invocation decides them
+    auto get_owner_cache(
+          std::size_t          _size
+        , std::chrono::seconds _time_to_live) -> lru_cache<std::string, std::string>&
+    {
+        static lru_cache<std::string, std::string> cache{_size, _time_to_live};
+        return cache;
+    } // get_owner_cache
+
+    auto get_owner_cache(const nlohmann::json& _configuration) -> lru_cache<std::string, std::string>&
+    {
+        namespace ok = owner_cache_keywords;
+
+        return get_owner_cache(
+                   _configuration.value(ok::owner_cache_size, 10000)
+                 , std::chrono::seconds{_configuration.value(ok::owner_cache_ttl_seconds, 300)});
+    } // get_owner_cache
+
+    // returns the owner of a data object, or an empty string if it does not exist
+    auto get_data_object_owner(
+          rsComm_t*             _comm
+        , const nlohmann::json& _configuration
+        , const std::string&    _logical_path) -> std::string
+    {
+        auto& cache = get_owner_cache(_configuration);
+
+        const auto key = "d:" + _logical_path;
+        if(const auto owner = cache.get(key)) {
+            return *owner;
+        }
+
+        irods::experimental::filesystem::path p{_logical_path};
+
+        const auto query_str = fmt::format(
+                               "SELECT DATA_OWNER_NAME WHERE COLL_NAME = '{}' AND DATA_NAME = '{}'"
+                               , p.parent_path().string()
+                               , p.object_name().string());
+
+        irods::query<rsComm_t> qobj{_comm, query_str, 1};
+        if(0 == qobj.size()) {
+            return {};
+        }
+
+        const auto owner = qobj.front()[0];
+        cache.put(key, owner);
+
+        return owner;
+
+    } // get_data_object_owner
+
+    // returns the owner of a collection, or an empty string if it does not exist
+    auto get_collection_owner(
+          rsComm_t*             _comm
+        , const nlohmann::json& _configuration
+        , const std::string&    _logical_path) -> std::string
+    {
+        auto& cache = get_owner_cache(_configuration);
+
+        const auto key = "c:" + _logical_path;
+        if(const auto owner = cache.get(key)) {
+            return *owner;
+        }
+
+        const auto query_str = fmt::format(
+                               "SELECT COLL_OWNER_NAME WHERE COLL_NAME = '{}'"
+                               , _logical_path);
+
+        irods::query<rsComm_t> qobj{_comm, query_str, 1};
+        if(0 == qobj.size()) {
+            return {};
+        }
+
+        const auto owner = qobj.front()[0];
+        cache.put(key, owner);
+
+        return owner;
+
+    } // get_collection_owner
+
+    void invalidate_owner(const nlohmann::json& _configuration, const std::string& _logical_path)
+    {
+        auto& cache = get_owner_cache(_configuration);
+        cache.erase("d:" + _logical_path);
+        cache.erase("c:" + _logical_path);
+    } // invalidate_owner
+
+} // namespace irods::policy_composition::policy_engine
+
+#endif // IRODS_POLICY_ENGINE_OWNER_CACHE_HPP
@@ -2,8 +2,10 @@
 import sys
 
 import contextlib
+import os
 import tempfile
 
+from time import sleep
 
 
 
@@ -24,12 +26,19 @@ from .. import lib
 
 
 @contextlib.contextmanager
-def access_time_configured(arg=None):
+def access_time_configured(arg=None, plugin_specific_configuration=None):
     filename = paths.server_config_path()
     
     irods_config = IrodsConfig()
     irods_config.server_config['advanced_settings']['delay_server_sleep_time_in_seconds'] = 1
 
+    access_time_configuration = {
+        "log_errors" : "true"
+    }
+
+    if plugin_specific_configuration:
+        access_time_configuration.update(plugin_specific_configuration)
+
     irods_config.server_config['plugin_configuration']['rule_engines'].insert(0,
             {
                 "instance_name": "irods_rule_engine_plugin-event_handler-data_object_modified-instance",
@@ -51,9 +60,7 @@ def access_time_configured(arg=None):
            {
                 "instance_name": "irods_rule_engine_plugin-policy_engine-access_time-instance",
                 "plugin_name": "irods_rule_engine_plugin-policy_engine-access_time",
-                "plugin_specific_configuration": {
-                    "log_errors" : "true"
-                }
+                "plugin_specific_configuration": access_time_configuration
            }
         )
 
@@ -175,6 +182,40 @@ OUTPUT ruleExecOut"""
 
 
 
+    def test_direct_invocation_dry_run(self):
+        with session.make_session_for_existing_admin() as admin_session:
+            try:
+                filename = 'test_put_file'
+                lib.create_local_testfile(filename)
+                admin_session.assert_icommand('iput ' + filename)
+
+                rule = """
+{
+    "policy_to_invoke" : "irods_policy_execute_rule",
+    "parameters" : {
+        "policy_to_invoke" : "irods_policy_access_time",
+        "parameters" : {
+            "user_name" : "rods",
+            "logical_path" : "/tempZone/home/rods/test_put_file",
+            "dry_run" : "true"
+        },
+        "configuration" : {
+        }
+    }
+}
+INPUT null
+OUTPUT ruleExecOut"""
+
+                rule_file = tempfile.NamedTemporaryFile(mode='wt', dir='/tmp', delete=False).name + '.r'
+                with open(rule_file, 'w') as f:
+                    f.write(rule)
+
+                with access_time_configured():
+                    admin_session.assert_icommand(['irule', '-r', 'irods_rule_engine_plugin-cpp_default_policy-instance', '-F', rule_file], 'STDOUT_SINGLELINE', 'access')
+                    admin_session.assert_icommand('imeta ls -d ' + filename, 'STDOUT_SINGLELINE', 'None')
+            finally:
+                admin_session.assert_icommand('irm -f ' + filename)
+
     def test_event_handler_invocation(self):
         with session.make_session_for_existing_admin() as admin_session:
             with access_time_configured():
@@ -232,6 +273,331 @@ OUTPUT ruleExecOut"""
 
 
 
+    def test_direct_invocation_with_throttle(self):
+        with session.make_session_for_existing_admin() as admin_session:
+            try:
+                filename = 'test_put_file'
+                lib.create_local_testfile(filename)
+                admin_session.assert_icommand('iput ' + filename)
+                admin_session.assert_icommand('imeta ls -d ' + filename, 'STDOUT_SINGLELINE', 'None')
+
+                rule = """
+{
+    "policy_to_invoke" : "irods_policy_execute_rule",
+    "parameters" : {
+        "policy_to_invoke" : "irods_policy_access_time",
+        "parameters" : {
+            "user_name" : "rods",
+            "logical_path" : "/tempZone/home/rods/test_put_file"
+        },
+        "configuration" : {
+            "throttle" : {
+                "operations_per_second" : 1,
+                "burst_seconds" : 1
+            }
+        }
+    }
+}
+INPUT null
+OUTPUT ruleExecOut"""
+
+                rule_file = tempfile.NamedTemporaryFile(mode='wt', dir='/tmp', delete=False).name + '.r'
+                with open(rule_file, 'w') as f:
+                    f.write(rule)
+
+                with access_time_configured():
+                    admin_session.assert_icommand(['irule', '-r', 'irods_rule_engine_plugin-cpp_default_policy-instance', '-F', rule_file], 'STDOUT_SINGLELINE', 'access')
+                    admin_session.assert_icommand('imeta ls -d ' + filename, 'STDOUT_SINGLELINE', 'irods::access_time')
+            finally:
+                admin_session.assert_icommand('irm -f ' + filename)
+
+
+
+    def test_direct_invocation_with_granularity(self):
+        with session.make_session_for_existing_admin() as admin_session:
+            try:
+                filename = 'test_put_file'
+                lib.create_local_testfile(filename)
+                admin_session.assert_icommand('iput ' + filename)
+                admin_session.assert_icommand('imeta ls -d ' + filename, 'STDOUT_SINGLELINE', 'None')
+
+                rule = """
+{
+    "policy_to_invoke" : "irods_policy_execute_rule",
+    "parameters" : {
+        "policy_to_invoke" : "irods_policy_access_time",
+        "parameters" : {
+            "user_name" : "rods",
+            "logical_path" : "/tempZone/home/rods/test_put_file"
+        },
+        "configuration" : {
+            "granularity_seconds" : 3600
+        }
+    }
+}
+INPUT null
+OUTPUT ruleExecOut"""
+
+                rule_file = tempfile.NamedTemporaryFile(mode='wt', dir='/tmp', delete=False).name + '.r'
+                with open(rule_file, 'w') as f:
+                    f.write(rule)
+
+                with access_time_configured():
+                    admin_session.assert_icommand(['irule', '-r', 'irods_rule_engine_plugin-cpp_default_policy-instance', '-F', rule_file], 'STDOUT_SINGLELINE', 'access')
+                    first, _, _ = admin_session.run_icommand('imeta ls -d ' + filename + ' irods::access_time')
+
+                    # the second access falls within the granularity and is not stamped
+                    sleep(2)
+                    admin_session.assert_icommand(['irule', '-r', 'irods_rule_engine_plugin-cpp_default_policy-instance', '-F', rule_file], 'STDOUT_SINGLELINE', 'access')
+                    second, _, _ = admin_session.run_icommand('imeta ls -d ' + filename + ' irods::access_time')
+
+                    assert 'irods::access_time' in first
+                    assert first == second
+            finally:
+                admin_session.assert_icommand('irm -f ' + filename)
+
+
+
+    def test_direct_invocation_with_write_behind(self):
+        with session.make_session_for_existing_admin() as admin_session:
+            try:
+                filename = 'test_put_file'
+                lib.create_local_testfile(filename)
+                admin_session.assert_icommand('iput ' + filename)
+                admin_session.assert_icommand('imeta ls -d ' + filename, 'STDOUT_SINGLELINE', 'None')
+
+                configuration = """
+            "write_behind" : "true",
+            "write_behind_entries" : 1,
+            "write_behind_spool" : "/tmp/test_access_time_write_behind.spool"
+"""
+
+                access_rule = """
+{
+    "policy_to_invoke" : "irods_policy_execute_rule",
+    "parameters" : {
+        "policy_to_invoke" : "irods_policy_access_time",
+        "parameters" : {
+            "user_name" : "rods",
+            "logical_path" : "/tempZone/home/rods/test_put_file"
+        },
+        "configuration" : {
+%s
+        }
+    }
+}
+INPUT null
+OUTPUT ruleExecOut""" % configuration
+
+                flush_rule = """
+{
+    "policy_to_invoke" : "irods_policy_execute_rule",
+    "parameters" : {
+        "policy_to_invoke" : "irods_policy_access_time",
+        "parameters" : {
+            "mode" : "flush"
+        },
+        "configuration" : {
+%s
+        }
+    }
+}
+INPUT null
+OUTPUT ruleExecOut""" % configuration
+
+                access_rule_file = tempfile.NamedTemporaryFile(mode='wt', dir='/tmp', delete=False).name + '.r'
+                with open(access_rule_file, 'w') as f:
+                    f.write(access_rule)
+
+                flush_rule_file = tempfile.NamedTemporaryFile(mode='wt', dir='/tmp', delete=False).name + '.r'
+                with open(flush_rule_file, 'w') as f:
+                    f.write(flush_rule)
+
+                with access_time_configured():
+                    admin_session.assert_icommand(['irule', '-r', 'irods_rule_engine_plugin-cpp_default_policy-instance', '-F', access_rule_file], 'STDOUT_SINGLELINE', 'access')
+                    admin_session.assert_icommand('imeta ls -d ' + filename, 'STDOUT_SINGLELINE', 'None')
+
+                    # a spool named by the invocation is ignored
+                    assert not os.path.exists('/tmp/test_access_time_write_behind.spool')
+
+                    admin_session.assert_icommand(['irule', '-r', 'irods_rule_engine_plugin-cpp_default_policy-instance', '-F', flush_rule_file], 'STDOUT_SINGLELINE', 'flushed [1]')
+                    admin_session.assert_icommand('imeta ls -d ' + filename, 'STDOUT_SINGLELINE', 'irods::access_time')
+            finally:
+                admin_session.assert_icommand('irm -f ' + filename)
+
+
+
+    def test_direct_invocation_collection_bulk_update(self):
+        with session.make_session_for_existing_admin() as admin_session:
+            try:
+                collection = 'test_access_time_bulk'
+                admin_session.assert_icommand('imkdir ' + collection)
+                for i in range(3):
+                    filename = 'test_put_file_' + str(i)
+                    lib.create_local_testfile(filename)
+                    admin_session.assert_icommand('iput ' + filename + ' ' + collection)
+
+                # an attribute matching the name when _ is a wildcard, and a previous access time
+                admin_session.assert_icommand('imeta add -d ' + collection + '/test_put_file_0 irods::accessXtime 1')
+                admin_session.assert_icommand('imeta add -d ' + collection + '/test_put_file_1 irods::access_time 1')
+
+                rule = """
+{
+    "policy_to_invoke" : "irods_policy_execute_rule",
+    "parameters" : {
+        "policy_to_invoke" : "irods_policy_access_time",
+        "parameters" : {
+            "user_name" : "rods",
+            "logical_path" : "/tempZone/home/rods/test_access_time_bulk",
+            "cond_input" : {
+                "collection" : "1"
+            }
+        },
+        "configuration" : {
+            "bulk_update_threshold" : 2
+        }
+    }
+}
+INPUT null
+OUTPUT ruleExecOut"""
+
+                rule_file = tempfile.NamedTemporaryFile(mode='wt', dir='/tmp', delete=False).name + '.r'
+                with open(rule_file, 'w') as f:
+                    f.write(rule)
+
+                with access_time_configured():
+                    admin_session.assert_icommand(['irule', '-r', 'irods_rule_engine_plugin-cpp_default_policy-instance', '-F', rule_file], 'STDOUT_SINGLELINE', 'access')
+                    for i in range(3):
+                        admin_session.assert_icommand('imeta ls -d ' + collection + '/test_put_file_' + str(i), 'STDOUT_SINGLELINE', 'irods::access_time')
+
+                    admin_session.assert_icommand('imeta ls -d ' + collection + '/test_put_file_0', 'STDOUT_SINGLELINE', 'irods::accessXtime')
+
+                    # the previous access time is replaced
+                    out, err, ec = admin_session.run_icommand('imeta ls -d ' + collection + '/test_put_file_1 irods::access_time')
+                    lib.log_command_result('imeta ls', out, err, ec)
+                    assert(out.count('attribute:') == 1)
+                    assert(out.find('value: 1\n') == -1)
+            finally:
+                admin_session.assert_icommand('irm -rf ' + collection)
+
+
+
+    def test_direct_invocation_collection_recursive(self):
+        with session.make_session_for_existing_admin() as admin_session:
+            # the _ within the name would match the sibling as a wildcard
+            collection = 'test_access_time_rec'
+            sibling    = 'test_access_timeXrec'
+            try:
+                admin_session.assert_icommand('imkdir -p ' + collection + '/sub')
+                admin_session.assert_icommand('imkdir ' + sibling)
+
+                filename = 'test_put_file'
+                lib.create_local_testfile(filename)
+                admin_session.assert_icommand('iput ' + filename + ' ' + collection)
+                admin_session.assert_icommand('iput ' + filename + ' ' + collection + '/sub')
+                admin_session.assert_icommand('iput ' + filename + ' ' + sibling)
+
+                rule = """
+{
+    "policy_to_invoke" : "irods_policy_execute_rule",
+    "parameters" : {
+        "policy_to_invoke" : "irods_policy_access_time",
+        "parameters" : {
+            "user_name" : "rods",
+            "logical_path" : "/tempZone/home/rods/test_access_time_rec",
+            "cond_input" : {
+                "collection" : "1"
+            }
+        },
+        "configuration" : {
+        }
+    }
+}
+INPUT null
+OUTPUT ruleExecOut"""
+
+                rule_file = tempfile.NamedTemporaryFile(mode='wt', dir='/tmp', delete=False).name + '.r'
+                with open(rule_file, 'w') as f:
+                    f.write(rule)
+
+                with access_time_configured():
+                    admin_session.assert_icommand(['irule', '-r', 'irods_rule_engine_plugin-cpp_default_policy-instance', '-F', rule_file], 'STDOUT_SINGLELINE', 'access')
+                    admin_session.assert_icommand('imeta ls -d ' + collection + '/' + filename, 'STDOUT_SINGLELINE', 'irods::access_time')
+                    admin_session.assert_icommand('imeta ls -d ' + collection + '/sub/' + filename, 'STDOUT_SINGLELINE', 'irods::access_time')
+                    admin_session.assert_icommand('imeta ls -d ' + sibling + '/' + filename, 'STDOUT_SINGLELINE', 'None')
+            finally:
+                admin_session.assert_icommand('irm -rf ' + collection)
+                admin_session.assert_icommand('irm -rf ' + sibling)
+
+
+
+    def run_owner_cache_rule(self, admin_session, body):
+        # each rule runs within a single agent, which holds the owner cache
+        rule = """
+test_owner_cache {
+    *params = '{"user_name" : "rods", "logical_path" : "/tempZone/home/rods/test_put_file"}';
+    *out = "";
+%s
+    writeLine("stdout", "result [*result]");
+}
+INPUT null
+OUTPUT ruleExecOut
+""" % body
+
+        rule_file = tempfile.NamedTemporaryFile(mode='wt', dir='/tmp', delete=False).name + '.r'
+        with open(rule_file, 'w') as f:
+            f.write(rule)
+
+        out, err, ec = admin_session.run_icommand(['irule', '-r', 'irods_rule_engine_plugin-irods_rule_language-instance', '-F', rule_file])
+        lib.log_command_result('irule', out, err, ec)
+        return out
+
+    def test_owner_cache_invalidated_by_rename(self):
+        with session.make_session_for_existing_admin() as admin_session:
+            try:
+                filename = 'test_put_file'
+                lib.create_local_testfile(filename)
+                admin_session.assert_icommand('iput ' + filename)
+
+                # the owner is cached, the object is renamed and the policy invoked for
+                # the RENAME of the source, after which the owner is no longer cached
+                body = """
+    *config = '{}';
+    irods_policy_access_time(*params, *config, *out);
+    msiDataObjRename("/tempZone/home/rods/test_put_file", "/tempZone/home/rods/test_put_file_renamed", "0", *status);
+    *rename = '{"user_name" : "rods", "logical_path" : "/tempZone/home/rods/test_put_file", "event" : "RENAME"}';
+    irods_policy_access_time(*rename, *config, *out);
+    *result = errorcode(irods_policy_access_time(*params, *config, *out));
+"""
+
+                with access_time_configured():
+                    out = self.run_owner_cache_rule(admin_session, body)
+
+                # the owner is looked up and not found, rather than the cached owner used
+                assert 'result [-808000]' in out
+            finally:
+                admin_session.assert_icommand('irm -f test_put_file_renamed')
+
+    def test_owner_cache_expires(self):
+        with session.make_session_for_existing_admin() as admin_session:
+            filename = 'test_put_file'
+            lib.create_local_testfile(filename)
+            admin_session.assert_icommand('iput ' + filename)
+
+            # unlink is not among the configured events so the entry is only dropped by expiry
+            body = """
+    *config = '{}';
+    irods_policy_access_time(*params, *config, *out);
+    msiDataObjUnlink("objPath=/tempZone/home/rods/test_put_file++++forceFlag=", *status);
+    msiSleep("2", "0");
+    *result = errorcode(irods_policy_access_time(*params, *config, *out));
+"""
+
+            with access_time_configured(plugin_specific_configuration={"owner_cache_ttl_seconds" : 1}):
+                out = self.run_owner_cache_rule(admin_session, body)
+
+            assert 'result [-808000]' in out
+
     def test_direct_invocation_alternate_attribute(self):
         with session.make_session_for_existing_admin() as admin_session:
             try:
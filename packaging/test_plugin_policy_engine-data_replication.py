@@ -1,4 +1,7 @@
 
+import json
+import os
+import shutil
 import sys
 
 import contextlib
@@ -24,19 +27,24 @@ from .. import lib
 
 
 @contextlib.contextmanager
-def data_replication_configured(arg=None):
+def data_replication_configured(arg=None, plugin_specific_configuration=None):
     filename = paths.server_config_path()
 
     irods_config = IrodsConfig()
     irods_config.server_config['advanced_settings']['delay_server_sleep_time_in_seconds'] = 1
 
+    replication_configuration = {
+        "log_errors" : "true"
+    }
+
+    if plugin_specific_configuration:
+        replication_configuration.update(plugin_specific_configuration)
+
     irods_config.server_config['plugin_configuration']['rule_engines'].insert(0,
            {
                 "instance_name": "irods_rule_engine_plugin-policy_engine-data_replication-instance",
                 "plugin_name": "irods_rule_engine_plugin-policy_engine-data_replication",
-                "plugin_specific_configuration": {
-                    "log_errors" : "true"
-                }
+                "plugin_specific_configuration": replication_configuration
            }
         )
 
@@ -307,6 +315,46 @@ OUTPUT ruleExecOut"""
 
 
 
+    def test_direct_invocation_dry_run(self):
+        with session.make_session_for_existing_admin() as admin_session:
+            try:
+                filename = 'test_put_file'
+                lib.create_local_testfile(filename)
+                admin_session.assert_icommand('iput ' + filename)
+
+                rule = """
+{
+    "policy_to_invoke" : "irods_policy_execute_rule",
+    "parameters" : {
+        "policy_to_invoke" : "irods_policy_data_replication",
+        "parameters" : {
+            "user_name" : "rods",
+            "logical_path" : "/tempZone/home/rods/test_put_file",
+            "source_resource" : "demoResc",
+            "destination_resource" : "AnotherResc",
+            "dry_run" : "true"
+        },
+        "configuration" : {
+        }
+    }
+}
+INPUT null
+OUTPUT ruleExecOut"""
+
+                rule_file = tempfile.NamedTemporaryFile(mode='wt', dir='/tmp', delete=False).name + '.r'
+                with open(rule_file, 'w') as f:
+                    f.write(rule)
+
+                with data_replication_configured():
+                    admin_session.assert_icommand(['irule', '-r', 'irods_rule_engine_plugin-cpp_default_policy-instance', '-F', rule_file], 'STDOUT_SINGLELINE', 'usage')
+                    out, err, ec = admin_session.run_icommand('ils -l ' + filename)
+                    lib.log_command_result('ils -l', out, err, ec)
+                    assert(out.find('AnotherResc') == -1)
+            finally:
+                admin_session.assert_icommand('irm -f ' + filename)
+
+
+
     def test_direct_invocation_source_to_destination_map(self):
         with session.make_session_for_existing_admin() as admin_session:
             try:
@@ -347,6 +395,414 @@ OUTPUT ruleExecOut"""
 
 
 
+    def test_direct_invocation_source_to_destination_map_concurrent(self):
+        with session.make_session_for_existing_admin() as admin_session:
+            try:
+                filename = 'test_put_file'
+                lib.create_local_testfile(filename)
+                admin_session.assert_icommand('iput ' + filename)
+
+                rule = """
+{
+    "policy_to_invoke" : "irods_policy_execute_rule",
+    "parameters" : {
+        "policy_to_invoke" : "irods_policy_data_replication",
+        "parameters" : {
+            "user_name" : "rods",
+            "logical_path" : "/tempZone/home/rods/test_put_file",
+            "source_resource" : "demoResc"
+        },
+        "configuration" : {
+            "maximum_concurrent_replications" : 2,
+            "source_to_destination_map" : {
+                "demoResc" : ["TestResc", "AnotherResc"]
+            }
+        }
+    }
+}
+INPUT null
+OUTPUT ruleExecOut"""
+
+                rule_file = tempfile.NamedTemporaryFile(mode='wt', dir='/tmp', delete=False).name + '.r'
+                with open(rule_file, 'w') as f:
+                    f.write(rule)
+
+                with data_replication_configured():
+                    admin_session.assert_icommand(['irule', '-r', 'irods_rule_engine_plugin-cpp_default_policy-instance', '-F', rule_file], 'STDOUT_SINGLELINE', 'usage')
+                    admin_session.assert_icommand('ils -l '+filename, 'STDOUT_SINGLELINE', 'AnotherResc')
+                    admin_session.assert_icommand('ils -l '+filename, 'STDOUT_SINGLELINE', 'TestResc')
+            finally:
+                admin_session.assert_icommand('irm -f ' + filename)
+
+
+
+    def test_direct_invocation_source_to_destination_map_chain(self):
+        with session.make_session_for_existing_admin() as admin_session:
+            try:
+                filename = 'test_put_file'
+                lib.create_local_testfile(filename)
+                admin_session.assert_icommand('iput ' + filename)
+
+                rule = """
+{
+    "policy_to_invoke" : "irods_policy_execute_rule",
+    "parameters" : {
+        "policy_to_invoke" : "irods_policy_data_replication",
+        "parameters" : {
+            "user_name" : "rods",
+            "logical_path" : "/tempZone/home/rods/test_put_file",
+            "source_resource" : "demoResc"
+        },
+        "configuration" : {
+            "replication_topology" : "chain",
+            "source_to_destination_map" : {
+                "demoResc" : ["TestResc", "AnotherResc"]
+            }
+        }
+    }
+}
+INPUT null
+OUTPUT ruleExecOut"""
+
+                rule_file = tempfile.NamedTemporaryFile(mode='wt', dir='/tmp', delete=False).name + '.r'
+                with open(rule_file, 'w') as f:
+                    f.write(rule)
+
+                with data_replication_configured():
+                    admin_session.assert_icommand(['irule', '-r', 'irods_rule_engine_plugin-cpp_default_policy-instance', '-F', rule_file], 'STDOUT_SINGLELINE', 'usage')
+                    admin_session.assert_icommand('ils -l '+filename, 'STDOUT_SINGLELINE', 'AnotherResc')
+                    admin_session.assert_icommand('ils -l '+filename, 'STDOUT_SINGLELINE', 'TestResc')
+            finally:
+                admin_session.assert_icommand('irm -f ' + filename)
+
+
+
+    def test_direct_invocation_bulk(self):
+        with session.make_session_for_existing_admin() as admin_session:
+            filenames = ['test_put_file_' + str(i) for i in range(3)]
+            try:
+                for filename in filenames:
+                    lib.create_local_testfile(filename)
+                    admin_session.assert_icommand('iput ' + filename)
+
+                admin_session.assert_icommand('irepl -R AnotherResc ' + filenames[0])
+
+                rule = """
+{
+    "policy_to_invoke" : "irods_policy_execute_rule",
+    "parameters" : {
+        "policy_to_invoke" : "irods_policy_data_replication",
+        "parameters" : {
+            "user_name" : "rods",
+            "source_resource" : "demoResc",
+            "destination_resource" : "AnotherResc",
+            "logical_paths" : ["/tempZone/home/rods/test_put_file_0", "/tempZone/home/rods/test_put_file_1", "/tempZone/home/rods/test_put_file_2"]
+        },
+        "configuration" : {
+            "bulk_batch_size" : 2
+        }
+    }
+}
+INPUT null
+OUTPUT ruleExecOut"""
+
+                rule_file = tempfile.NamedTemporaryFile(mode='wt', dir='/tmp', delete=False).name + '.r'
+                with open(rule_file, 'w') as f:
+                    f.write(rule)
+
+                with data_replication_configured():
+                    admin_session.assert_icommand(['irule', '-r', 'irods_rule_engine_plugin-cpp_default_policy-instance', '-F', rule_file], 'STDOUT_SINGLELINE', '"already_replicated":1')
+                    for filename in filenames:
+                        admin_session.assert_icommand('ils -l '+filename, 'STDOUT_SINGLELINE', 'AnotherResc')
+            finally:
+                for filename in filenames:
+                    admin_session.assert_icommand('irm -f ' + filename)
+
+
+
+    def test_direct_invocation_with_destination_limits(self):
+        slot_directory = '/tmp/test_replication_slots'
+        with session.make_session_for_existing_admin() as admin_session:
+            try:
+                filename = 'test_put_file'
+                lib.create_local_testfile(filename)
+                admin_session.assert_icommand('iput ' + filename)
+
+                rule = """
+{
+    "policy_to_invoke" : "irods_policy_execute_rule",
+    "parameters" : {
+        "policy_to_invoke" : "irods_policy_data_replication",
+        "parameters" : {
+            "user_name" : "rods",
+            "logical_path" : "/tempZone/home/rods/test_put_file",
+            "source_resource" : "demoResc",
+            "destination_resource" : "AnotherResc"
+        },
+        "configuration" : {
+            "destination_limits" : {
+                "AnotherResc" : {
+                    "maximum_concurrent" : 1,
+                    "bytes_per_second" : 1048576
+                }
+            }
+        }
+    }
+}
+INPUT null
+OUTPUT ruleExecOut"""
+
+                rule_file = tempfile.NamedTemporaryFile(mode='wt', dir='/tmp', delete=False).name + '.r'
+                with open(rule_file, 'w') as f:
+                    f.write(rule)
+
+                with data_replication_configured(plugin_specific_configuration={"slot_directory" : slot_directory}):
+                    admin_session.assert_icommand(['irule', '-r', 'irods_rule_engine_plugin-cpp_default_policy-instance', '-F', rule_file], 'STDOUT_SINGLELINE', 'usage')
+                    admin_session.assert_icommand('ils -l '+filename, 'STDOUT_SINGLELINE', 'AnotherResc')
+                    assert os.path.exists(os.path.join(slot_directory, 'AnotherResc.slot.0'))
+                    assert os.path.exists(os.path.join(slot_directory, 'AnotherResc.bandwidth'))
+            finally:
+                admin_session.assert_icommand('irm -f ' + filename)
+                shutil.rmtree(slot_directory, ignore_errors=True)
+
+
+
+    def test_direct_invocation_with_verify_checksum(self):
+        with session.make_session_for_existing_admin() as admin_session:
+            try:
+                filename = 'test_put_file'
+                lib.create_local_testfile(filename)
+                admin_session.assert_icommand('iput ' + filename)
+
+                rule = """
+{
+    "policy_to_invoke" : "irods_policy_execute_rule",
+    "parameters" : {
+        "policy_to_invoke" : "irods_policy_data_replication",
+        "parameters" : {
+            "user_name" : "rods",
+            "logical_path" : "/tempZone/home/rods/test_put_file",
+            "source_resource" : "demoResc",
+            "destination_resource" : "AnotherResc"
+        },
+        "configuration" : {
+            "verify_checksum" : "true"
+        }
+    }
+}
+INPUT null
+OUTPUT ruleExecOut"""
+
+                rule_file = tempfile.NamedTemporaryFile(mode='wt', dir='/tmp', delete=False).name + '.r'
+                with open(rule_file, 'w') as f:
+                    f.write(rule)
+
+                with data_replication_configured():
+                    admin_session.assert_icommand(['irule', '-r', 'irods_rule_engine_plugin-cpp_default_policy-instance', '-F', rule_file], 'STDOUT_SINGLELINE', 'usage')
+                    admin_session.assert_icommand('ils -L '+filename, 'STDOUT_SINGLELINE', 'AnotherResc')
+                    admin_session.assert_icommand('ils -L '+filename, 'STDOUT_SINGLELINE', 'sha2:')
+            finally:
+                admin_session.assert_icommand('irm -f ' + filename)
+
+
+
+    def test_direct_invocation_with_delta_sync(self):
+        with session.make_session_for_existing_admin() as admin_session:
+            try:
+                filename = 'test_put_file'
+                lib.make_file(filename, 1024 * 1024, 'arbitrary')
+                admin_session.assert_icommand('iput -R demoResc ' + filename)
+                admin_session.assert_icommand('irepl -R AnotherResc ' + filename)
+
+                with open(filename, 'r+b') as f:
+                    f.seek(4096)
+                    f.write(b'updated block')
+                admin_session.assert_icommand('iput -f -R demoResc ' + filename)
+                admin_session.assert_icommand('ils -l ' + filename, 'STDOUT_SINGLELINE', 'X')
+
+                rule = """
+{
+    "policy_to_invoke" : "irods_policy_execute_rule",
+    "parameters" : {
+        "policy_to_invoke" : "irods_policy_data_replication",
+        "parameters" : {
+            "user_name" : "rods",
+            "logical_path" : "/tempZone/home/rods/test_put_file",
+            "source_resource" : "demoResc",
+            "destination_resource" : "AnotherResc"
+        },
+        "configuration" : {
+            "delta_sync" : "true",
+            "delta_block_size" : 65536
+        }
+    }
+}
+INPUT null
+OUTPUT ruleExecOut"""
+
+                rule_file = tempfile.NamedTemporaryFile(mode='wt', dir='/tmp', delete=False).name + '.r'
+                with open(rule_file, 'w') as f:
+                    f.write(rule)
+
+                with data_replication_configured():
+                    admin_session.assert_icommand(['irule', '-r', 'irods_rule_engine_plugin-cpp_default_policy-instance', '-F', rule_file], 'STDOUT_SINGLELINE', 'usage')
+                    admin_session.assert_icommand_fail('ils -l ' + filename, 'STDOUT_SINGLELINE', 'X')
+
+                    # the updated replica is verified against the checksum of the source
+                    admin_session.assert_icommand('ils -L ' + filename, 'STDOUT_SINGLELINE', 'sha2:')
+
+                    admin_session.assert_icommand('iget -f -R AnotherResc ' + filename + ' ' + filename + '.get')
+                    with open(filename, 'rb') as a, open(filename + '.get', 'rb') as b:
+                        assert a.read() == b.read()
+            finally:
+                admin_session.assert_icommand('irm -f ' + filename)
+                for f in [filename, filename + '.get']:
+                    if os.path.exists(f):
+                        os.unlink(f)
+
+
+
+    def stale_replica_for_delta_sync(self, admin_session, filename, size):
+        # a good replica on demoResc of the given size and a stale replica on AnotherResc
+        lib.make_file(filename, 1024 * 1024, 'arbitrary')
+        admin_session.assert_icommand('iput -R demoResc ' + filename)
+        admin_session.assert_icommand('irepl -R AnotherResc ' + filename)
+
+        with open(filename, 'r+b') as f:
+            f.seek(4096)
+            f.write(b'updated block')
+            f.truncate(size)
+        admin_session.assert_icommand('iput -f -R demoResc ' + filename)
+        admin_session.assert_icommand('ils -l ' + filename, 'STDOUT_SINGLELINE', 'X')
+
+    def invoke_delta_sync(self, admin_session, configuration):
+        configuration.update({"delta_sync" : "true", "delta_block_size" : 65536})
+
+        rule = """
+{
+    "policy_to_invoke" : "irods_policy_execute_rule",
+    "parameters" : {
+        "policy_to_invoke" : "irods_policy_data_replication",
+        "parameters" : {
+            "user_name" : "rods",
+            "logical_path" : "/tempZone/home/rods/test_put_file",
+            "source_resource" : "demoResc",
+            "destination_resource" : "AnotherResc"
+        },
+        "configuration" : %s
+    }
+}
+INPUT null
+OUTPUT ruleExecOut""" % json.dumps(configuration)
+
+        rule_file = tempfile.NamedTemporaryFile(mode='wt', dir='/tmp', delete=False).name + '.r'
+        with open(rule_file, 'w') as f:
+            f.write(rule)
+
+        out, err, ec = admin_session.run_icommand(['irule', '-r', 'irods_rule_engine_plugin-cpp_default_policy-instance', '-F', rule_file])
+        lib.log_command_result('irule', out, err, ec)
+
+    def assert_replicas_match(self, admin_session, filename):
+        admin_session.assert_icommand_fail('ils -l ' + filename, 'STDOUT_SINGLELINE', 'X')
+        admin_session.assert_icommand('ils -L ' + filename, 'STDOUT_SINGLELINE', 'sha2:')
+
+        admin_session.assert_icommand('iget -f -R AnotherResc ' + filename + ' ' + filename + '.get')
+        with open(filename, 'rb') as a, open(filename + '.get', 'rb') as b:
+            assert a.read() == b.read()
+
+    def test_direct_invocation_with_delta_sync_truncate(self):
+        with session.make_session_for_existing_admin() as admin_session:
+            filename = 'test_put_file'
+            try:
+                # the source shrinks, so the destination is truncated after the blocks are written
+                self.stale_replica_for_delta_sync(admin_session, filename, 512 * 1024 + 100)
+
+                with data_replication_configured():
+                    self.invoke_delta_sync(admin_session, {})
+                    self.assert_replicas_match(admin_session, filename)
+            finally:
+                admin_session.assert_icommand('irm -f ' + filename)
+                for f in [filename, filename + '.get']:
+                    if os.path.exists(f):
+                        os.unlink(f)
+
+    def test_direct_invocation_with_delta_sync_local_fallback(self):
+        with session.make_session_for_existing_admin() as admin_session:
+            filename = 'test_put_file'
+            try:
+                self.stale_replica_for_delta_sync(admin_session, filename, 1024 * 1024)
+
+                # no such instance exists so the digests are computed through this agent
+                with data_replication_configured():
+                    self.invoke_delta_sync(admin_session, {
+                        "delta_sync_policy_instance" : "irods_rule_engine_plugin-no_such_instance",
+                        "delta_sync_local_fallback" : "true"})
+                    self.assert_replicas_match(admin_session, filename)
+            finally:
+                admin_session.assert_icommand('irm -f ' + filename)
+                for f in [filename, filename + '.get']:
+                    if os.path.exists(f):
+                        os.unlink(f)
+
+    def test_direct_invocation_with_delta_sync_without_fallback(self):
+        with session.make_session_for_existing_admin() as admin_session:
+            filename = 'test_put_file'
+            try:
+                self.stale_replica_for_delta_sync(admin_session, filename, 1024 * 1024)
+
+                # the digests cannot be computed next to the replicas, the replica stays stale
+                with data_replication_configured():
+                    self.invoke_delta_sync(admin_session, {
+                        "delta_sync_policy_instance" : "irods_rule_engine_plugin-no_such_instance"})
+                    admin_session.assert_icommand('ils -l ' + filename, 'STDOUT_SINGLELINE', 'X')
+            finally:
+                admin_session.assert_icommand('irm -f ' + filename)
+                if os.path.exists(filename):
+                    os.unlink(filename)
+
+    def test_direct_invocation_refresh(self):
+        with session.make_session_for_existing_admin() as admin_session:
+            try:
+                filename = 'test_put_file'
+                lib.create_local_testfile(filename)
+                admin_session.assert_icommand('iput -R demoResc ' + filename)
+                admin_session.assert_icommand('irepl -R AnotherResc ' + filename)
+                admin_session.assert_icommand('iput -f -R demoResc ' + filename)
+
+                rule = """
+{
+    "policy_to_invoke" : "irods_policy_execute_rule",
+    "parameters" : {
+        "policy_to_invoke" : "irods_policy_data_replication",
+        "parameters" : {
+            "user_name" : "rods",
+            "logical_path" : "/tempZone/home/rods/test_put_file",
+            "source_resource" : "demoResc"
+        },
+        "configuration" : {
+            "refresh" : "true",
+            "source_to_destination_map" : {
+                "demoResc" : ["TestResc", "AnotherResc"]
+            }
+        }
+    }
+}
+INPUT null
+OUTPUT ruleExecOut"""
+
+                rule_file = tempfile.NamedTemporaryFile(mode='wt', dir='/tmp', delete=False).name + '.r'
+                with open(rule_file, 'w') as f:
+                    f.write(rule)
+
+                with data_replication_configured():
+                    admin_session.assert_icommand(['irule', '-r', 'irods_rule_engine_plugin-cpp_default_policy-instance', '-F', rule_file], 'STDOUT_SINGLELINE', '"created":1')
+                    admin_session.assert_icommand('ils -l '+filename, 'STDOUT_SINGLELINE', 'TestResc')
+                    admin_session.assert_icommand_fail('ils -l ' + filename, 'STDOUT_SINGLELINE', 'X')
+            finally:
+                admin_session.assert_icommand('irm -f ' + filename)
+
+
+
     def test_event_handler_invocation(self):
         with session.make_session_for_existing_admin() as admin_session:
             with data_replication_with_event_handler_configured():
@@ -362,6 +362,68 @@ def data_retention_alternate_attributes_configured(arg=None):
     finally:
         IrodsController().reload_configuration()
 
+@contextlib.contextmanager
+def data_retention_trim_single_with_metadata_configured(arg=None):
+    filename = paths.server_config_path()
+
+    irods_config = IrodsConfig()
+    irods_config.server_config['advanced_settings']['delay_server_sleep_time_in_seconds'] = 1
+
+    irods_config.server_config['plugin_configuration']['rule_engines'].insert(0,
+            {
+                "instance_name": "irods_rule_engine_plugin-event_handler-metadata_modified-instance",
+                "plugin_name": "irods_rule_engine_plugin-event_handler-metadata_modified",
+                "plugin_specific_configuration": {
+                    "policies_to_invoke" : [
+                        {   "active_policy_clauses" : ["post"],
+                            "events" : ["metadata"],
+                            "policy_to_invoke"    : "irods_policy_data_retention",
+                            "configuration" : {
+                                "mode" : "trim_single_replica"
+                            }
+                        }
+                    ]
+                }
+            }
+        )
+
+    irods_config.server_config['plugin_configuration']['rule_engines'].insert(0,
+            {
+                "instance_name": "irods_rule_engine_plugin-event_handler-data_object_modified-instance",
+                "plugin_name": "irods_rule_engine_plugin-event_handler-data_object_modified",
+                "plugin_specific_configuration": {
+                    "policies_to_invoke" : [
+                        {   "active_policy_clauses" : ["post"],
+                            "events" : ["replication"],
+                            "policy_to_invoke"    : "irods_policy_data_retention",
+                            "configuration" : {
+                                "mode" : "trim_single_replica"
+                            }
+                        }
+                    ]
+                }
+            }
+        )
+
+    irods_config.server_config['plugin_configuration']['rule_engines'].insert(0,
+           {
+                "instance_name": "irods_rule_engine_plugin-policy_engine-data_retention-instance",
+                "plugin_name": "irods_rule_engine_plugin-policy_engine-data_retention",
+                "plugin_specific_configuration": {
+                    "log_errors" : "true"
+                }
+           }
+        )
+
+
+    try:
+        with lib.file_backed_up(filename):
+            irods_config.commit(irods_config.server_config, irods_config.server_config_path)
+            IrodsController().reload_configuration()
+            yield
+    finally:
+        IrodsController().reload_configuration()
+
 class TestPolicyEngineDataRetention(ResourceBase, unittest.TestCase):
     def setUp(self):
         super(TestPolicyEngineDataRetention, self).setUp()
@@ -422,6 +484,43 @@ OUTPUT ruleExecOut"""
             finally:
                 admin_session.assert_icommand('irm -f ' + filename)
 
+    def test_direct_invocation_with_trim_single_dry_run(self):
+        with session.make_session_for_existing_admin() as admin_session:
+            try:
+                filename = 'test_put_file'
+                lib.create_local_testfile(filename)
+                admin_session.assert_icommand('iput -R rnd ' + filename)
+                admin_session.assert_icommand('irepl -R AnotherResc ' + filename)
+
+                rule = """
+{
+"policy_to_invoke" : "irods_policy_execute_rule",
+"parameters" : {
+    "policy_to_invoke" : "irods_policy_data_retention",
+    "parameters" : {
+        "user_name" : "rods",
+        "logical_path" : "/tempZone/home/rods/test_put_file",
+        "source_resource" : "rnd",
+        "dry_run" : "true"
+    },
+    "configuration" : {
+        "mode" : "trim_single_replica"
+    }
+}
+}
+INPUT null
+OUTPUT ruleExecOut"""
+
+                rule_file = tempfile.NamedTemporaryFile(mode='wt', dir='/tmp', delete=False).name + '.r'
+                with open(rule_file, 'w') as f:
+                    f.write(rule)
+
+                with data_retention_trim_single_direct_invocation_configured():
+                    admin_session.assert_icommand(['irule', '-r', 'irods_rule_engine_plugin-cpp_default_policy-instance', '-F', rule_file], 'STDOUT_SINGLELINE', '"operation":"trim"')
+                    admin_session.assert_icommand('ils -l ' + filename, 'STDOUT_SINGLELINE', 'rnd')
+            finally:
+                admin_session.assert_icommand('irm -f ' + filename)
+
     def test_direct_invocation_with_remove_all(self):
         with session.make_session_for_existing_admin() as admin_session:
             filename = 'test_put_file'
@@ -454,6 +553,81 @@ OUTPUT ruleExecOut"""
                 admin_session.assert_icommand(['irule', '-r', 'irods_rule_engine_plugin-cpp_default_policy-instance', '-F', rule_file], 'STDOUT_SINGLELINE', 'usage')
                 admin_session.assert_icommand('ils -l ' + filename, 'STDERR_SINGLELINE', 'does not exist')
 
+    def test_direct_invocation_with_bulk_remove_all(self):
+        with session.make_session_for_existing_admin() as admin_session:
+            filenames = ['test_put_file_' + str(i) for i in range(3)]
+            for filename in filenames:
+                lib.create_local_testfile(filename)
+                admin_session.assert_icommand('iput -R rnd ' + filename)
+                admin_session.assert_icommand('irepl -R AnotherResc ' + filename)
+
+            rule = """
+{
+"policy_to_invoke" : "irods_policy_execute_rule",
+"parameters" : {
+    "policy_to_invoke" : "irods_policy_data_retention",
+    "parameters" : {
+        "logical_paths" : ["/tempZone/home/rods/test_put_file_0", "/tempZone/home/rods/test_put_file_1", "/tempZone/home/rods/test_put_file_2"]
+    },
+    "configuration" : {
+        "mode" : "remove_all_replicas",
+        "bulk_batch_size" : 2,
+        "defer_physical_deletion" : "false"
+    }
+}
+}
+INPUT null
+OUTPUT ruleExecOut"""
+
+            rule_file = tempfile.NamedTemporaryFile(mode='wt', dir='/tmp', delete=False).name + '.r'
+            with open(rule_file, 'w') as f:
+                f.write(rule)
+
+            with data_retention_remove_all_direct_invocation_configured():
+                admin_session.assert_icommand(['irule', '-r', 'irods_rule_engine_plugin-cpp_default_policy-instance', '-F', rule_file], 'STDOUT_SINGLELINE', '"unlinked":3')
+                for filename in filenames:
+                    admin_session.assert_icommand('ils -l ' + filename, 'STDERR_SINGLELINE', 'does not exist')
+
+    def test_direct_invocation_with_trim_by_capacity(self):
+        with session.make_session_for_existing_admin() as admin_session:
+            try:
+                filename = 'test_put_file'
+                lib.create_local_testfile(filename)
+                admin_session.assert_icommand('iput ' + filename)
+                admin_session.assert_icommand('irepl -R AnotherResc ' + filename)
+                admin_session.assert_icommand('imeta set -d ' + filename + ' irods::access_time 1')
+
+                rule = """
+{
+"policy_to_invoke" : "irods_policy_execute_rule",
+"parameters" : {
+    "policy_to_invoke" : "irods_policy_data_retention",
+    "parameters" : {
+        "source_resource" : "AnotherResc"
+    },
+    "configuration" : {
+        "mode" : "trim_by_capacity",
+        "high_watermark" : 0,
+        "low_watermark" : 0
+    }
+}
+}
+INPUT null
+OUTPUT ruleExecOut"""
+
+                rule_file = tempfile.NamedTemporaryFile(mode='wt', dir='/tmp', delete=False).name + '.r'
+                with open(rule_file, 'w') as f:
+                    f.write(rule)
+
+                with data_retention_trim_single_direct_invocation_configured():
+                    admin_session.assert_icommand(['irule', '-r', 'irods_rule_engine_plugin-cpp_default_policy-instance', '-F', rule_file], 'STDOUT_SINGLELINE', '"trimmed":1')
+                    admin_session.assert_icommand('ils -l ' + filename, 'STDOUT_SINGLELINE', 'demoResc')
+                    out, err, ec = admin_session.run_icommand('ils -l ' + filename)
+                    lib.log_command_result('ils -l', out, err, ec)
+                    assert(out.find('AnotherResc') == -1)
+            finally:
+                admin_session.assert_icommand('irm -f ' + filename)
+
     def test_direct_invocation_with_preserve_replicas(self):
         with session.make_session_for_existing_admin() as admin_session:
             try:
@@ -551,6 +725,22 @@ OUTPUT ruleExecOut"""
 
 
 
+    def test_event_handler_invocation_with_trim_single_preserve_replica_set_by_event(self):
+        with session.make_session_for_existing_admin() as admin_session:
+            with data_retention_trim_single_with_metadata_configured():
+                try:
+                    filename = 'test_put_file'
+                    lib.create_local_testfile(filename)
+                    admin_session.assert_icommand('iput -R AnotherResc ' + filename)
+                    admin_session.assert_icommand('imeta set -R AnotherResc irods::retention::preserve_replicas true')
+                    admin_session.assert_icommand('irepl -R demoResc ' + filename, 'STDOUT_SINGLELINE', 'usage')
+                    admin_session.assert_icommand('ils -l ' + filename, 'STDOUT_SINGLELINE', 'AnotherResc')
+                finally:
+                    admin_session.assert_icommand('irm -f ' + filename)
+                    admin_session.assert_icommand('imeta rm -R AnotherResc irods::retention::preserve_replicas true')
+
+
+
     def test_query_invocation_with_trim_single(self):
         with session.make_session_for_existing_admin() as admin_session:
             try:
@@ -2,6 +2,7 @@
 import sys
 
 import contextlib
+import os
 import tempfile
 
 
@@ -61,7 +62,8 @@ def query_processor_configured(arg=None):
                 "instance_name": "irods_rule_engine_plugin-policy_engine-query_processor-instance",
                 "plugin_name": "irods_rule_engine_plugin-policy_engine-query_processor",
                 "plugin_specific_configuration": {
-                    "log_errors" : "true"
+                    "log_errors" : "true",
+                    "report_directory" : "/tmp"
                 }
            }
         )
@@ -389,3 +391,473 @@ OUTPUT ruleExecOut"""
             finally:
                 admin_session.assert_icommand('irm -f ' + filename)
                 admin_session.assert_icommand('iadmin rum')
+
+    def test_query_invocation_adaptive_number_of_threads(self):
+        with session.make_session_for_existing_admin() as admin_session:
+            try:
+                filename = 'test_put_file'
+                lib.create_local_testfile(filename)
+                admin_session.assert_icommand('iput ' + filename)
+                admin_session.assert_icommand('ils -l', 'STDOUT_SINGLELINE', filename)
+                admin_session.assert_icommand('imeta ls -d ' + filename, 'STDOUT_SINGLELINE', 'None')
+
+                rule = """
+{
+    "policy_to_invoke" : "irods_policy_execute_rule",
+    "parameters" : {
+        "policy_to_invoke" : "irods_policy_query_processor",
+        "parameters" : {
+              "query_string" : "SELECT USER_NAME, COLL_NAME, DATA_NAME, RESC_NAME WHERE COLL_NAME = '/tempZone/home/rods' AND DATA_NAME = 'test_put_file'",
+              "query_limit" : 1,
+              "query_type" : "general",
+              "number_of_threads" : "auto",
+              "minimum_number_of_threads" : 1,
+              "maximum_number_of_threads" : 4,
+              "thread_adjustment_window" : 1,
+              "policies_to_invoke" : [
+                  {
+                      "policy_to_invoke" : "irods_policy_testing_policy",
+                      "configuration" : {
+                      }
+                  }
+              ]
+         }
+    }
+}
+INPUT null
+OUTPUT ruleExecOut"""
+
+                rule_file = tempfile.NamedTemporaryFile(mode='wt', dir='/tmp', delete=False).name + '.r'
+                with open(rule_file, 'w') as f:
+                    f.write(rule)
+
+                with query_processor_configured():
+                    admin_session.assert_icommand(['irule', '-r', 'irods_rule_engine_plugin-cpp_default_policy-instance', '-F', rule_file], 'STDOUT_SINGLELINE', 'usage')
+                    admin_session.assert_icommand('imeta ls -d ' + filename, 'STDOUT_SINGLELINE', 'irods_policy_testing_policy')
+            finally:
+                admin_session.assert_icommand('irm -f ' + filename)
+                admin_session.assert_icommand('iadmin rum')
+
+    def test_query_invocation_with_affinity_column(self):
+        with session.make_session_for_existing_admin() as admin_session:
+            try:
+                filename = 'test_put_file'
+                lib.create_local_testfile(filename)
+                admin_session.assert_icommand('iput ' + filename)
+                admin_session.assert_icommand('ils -l', 'STDOUT_SINGLELINE', filename)
+                admin_session.assert_icommand('imeta ls -d ' + filename, 'STDOUT_SINGLELINE', 'None')
+
+                rule = """
+{
+    "policy_to_invoke" : "irods_policy_execute_rule",
+    "parameters" : {
+        "policy_to_invoke" : "irods_policy_query_processor",
+        "parameters" : {
+              "query_string" : "SELECT USER_NAME, COLL_NAME, DATA_NAME, RESC_NAME WHERE COLL_NAME = '/tempZone/home/rods' AND DATA_NAME = 'test_put_file'",
+              "query_limit" : 1,
+              "query_type" : "general",
+              "number_of_threads" : 4,
+              "affinity_column" : "RESC_NAME",
+              "affinity_concurrency_limit" : 1,
+              "policies_to_invoke" : [
+                  {
+                      "policy_to_invoke" : "irods_policy_testing_policy",
+                      "configuration" : {
+                      }
+                  }
+              ]
+         }
+    }
+}
+INPUT null
+OUTPUT ruleExecOut"""
+
+                rule_file = tempfile.NamedTemporaryFile(mode='wt', dir='/tmp', delete=False).name + '.r'
+                with open(rule_file, 'w') as f:
+                    f.write(rule)
+
+                with query_processor_configured():
+                    admin_session.assert_icommand(['irule', '-r', 'irods_rule_engine_plugin-cpp_default_policy-instance', '-F', rule_file], 'STDOUT_SINGLELINE', 'usage')
+                    admin_session.assert_icommand('imeta ls -d ' + filename, 'STDOUT_SINGLELINE', 'irods_policy_testing_policy')
+            finally:
+                admin_session.assert_icommand('irm -f ' + filename)
+                admin_session.assert_icommand('iadmin rum')
+
+    def test_query_invocation_with_watermark(self):
+        with session.make_session_for_existing_admin() as admin_session:
+            try:
+                filename = 'test_put_file'
+                lib.create_local_testfile(filename)
+                admin_session.assert_icommand('iput ' + filename)
+                admin_session.assert_icommand('ils -l', 'STDOUT_SINGLELINE', filename)
+                admin_session.assert_icommand('imeta ls -d ' + filename, 'STDOUT_SINGLELINE', 'None')
+
+                rule = """
+{
+    "policy_to_invoke" : "irods_policy_execute_rule",
+    "parameters" : {
+        "policy_to_invoke" : "irods_policy_query_processor",
+        "parameters" : {
+              "query_string" : "SELECT USER_NAME, COLL_NAME, DATA_NAME, RESC_NAME, DATA_MODIFY_TIME WHERE COLL_NAME = '/tempZone/home/rods' AND DATA_NAME = 'test_put_file' AND DATA_MODIFY_TIME > 'IRODS_TOKEN_LAST_RUN_TIME_END_TOKEN'",
+              "query_type" : "general",
+              "number_of_threads" : 1,
+              "watermark_name" : "test_watermark",
+              "watermark_column" : "DATA_MODIFY_TIME",
+              "policies_to_invoke" : [
+                  {
+                      "policy_to_invoke" : "irods_policy_testing_policy",
+                      "configuration" : {
+                      }
+                  }
+              ]
+         }
+    }
+}
+INPUT null
+OUTPUT ruleExecOut"""
+
+                rule_file = tempfile.NamedTemporaryFile(mode='wt', dir='/tmp', delete=False).name + '.r'
+                with open(rule_file, 'w') as f:
+                    f.write(rule)
+
+                with query_processor_configured():
+                    admin_session.assert_icommand(['irule', '-r', 'irods_rule_engine_plugin-cpp_default_policy-instance', '-F', rule_file], 'STDOUT_SINGLELINE', 'usage')
+                    admin_session.assert_icommand('imeta ls -d ' + filename, 'STDOUT_SINGLELINE', 'irods_policy_testing_policy')
+                    admin_session.assert_icommand('imeta ls -C /tempZone', 'STDOUT_SINGLELINE', 'irods::query_processor::watermark::test_watermark')
+
+                    # the object is older than the watermark and is not processed again
+                    admin_session.assert_icommand('imeta rmw -d ' + filename + ' irods_policy_testing_policy %')
+                    admin_session.assert_icommand(['irule', '-r', 'irods_rule_engine_plugin-cpp_default_policy-instance', '-F', rule_file], 'STDOUT_SINGLELINE', 'usage')
+                    admin_session.assert_icommand('imeta ls -d ' + filename, 'STDOUT_SINGLELINE', 'None')
+            finally:
+                admin_session.assert_icommand('imeta rmw -C /tempZone irods::query_processor::watermark::test_watermark %')
+                admin_session.assert_icommand('irm -f ' + filename)
+                admin_session.assert_icommand('iadmin rum')
+
+    def test_query_invocation_with_watermark_and_query_limit(self):
+        with session.make_session_for_existing_admin() as admin_session:
+            try:
+                filename = 'test_put_file'
+                lib.create_local_testfile(filename)
+                admin_session.assert_icommand('iput ' + filename)
+                admin_session.assert_icommand('ils -l', 'STDOUT_SINGLELINE', filename)
+                admin_session.assert_icommand('imeta ls -d ' + filename, 'STDOUT_SINGLELINE', 'None')
+
+                rule = """
+{
+    "policy_to_invoke" : "irods_policy_execute_rule",
+    "parameters" : {
+        "policy_to_invoke" : "irods_policy_query_processor",
+        "parameters" : {
+              "query_string" : "SELECT USER_NAME, COLL_NAME, DATA_NAME, RESC_NAME, DATA_MODIFY_TIME WHERE COLL_NAME = '/tempZone/home/rods' AND DATA_NAME = 'test_put_file' AND DATA_MODIFY_TIME > 'IRODS_TOKEN_LAST_RUN_TIME_END_TOKEN'",
+              "query_limit" : 1,
+              "query_type" : "general",
+              "number_of_threads" : 1,
+              "watermark_name" : "test_watermark",
+              "watermark_column" : "DATA_MODIFY_TIME",
+              "policies_to_invoke" : [
+                  {
+                      "policy_to_invoke" : "irods_policy_testing_policy",
+                      "configuration" : {
+                      }
+                  }
+              ]
+         }
+    }
+}
+INPUT null
+OUTPUT ruleExecOut"""
+
+                rule_file = tempfile.NamedTemporaryFile(mode='wt', dir='/tmp', delete=False).name + '.r'
+                with open(rule_file, 'w') as f:
+                    f.write(rule)
+
+                with query_processor_configured():
+                    # a limited run could advance the watermark past rows it never returned
+                    out, err, ec = admin_session.run_icommand(['irule', '-r', 'irods_rule_engine_plugin-cpp_default_policy-instance', '-F', rule_file])
+                    lib.log_command_result('irule', out, err, ec)
+                    admin_session.assert_icommand('imeta ls -d ' + filename, 'STDOUT_SINGLELINE', 'None')
+                    admin_session.assert_icommand_fail('imeta ls -C /tempZone', 'STDOUT_SINGLELINE', 'irods::query_processor::watermark::test_watermark')
+            finally:
+                admin_session.assert_icommand('irm -f ' + filename)
+                admin_session.assert_icommand('iadmin rum')
+
+    def test_query_invocation_dry_run(self):
+        with session.make_session_for_existing_admin() as admin_session:
+            try:
+                filename = 'test_put_file'
+                lib.create_local_testfile(filename)
+                admin_session.assert_icommand('iput ' + filename)
+                admin_session.assert_icommand('ils -l', 'STDOUT_SINGLELINE', filename)
+                admin_session.assert_icommand('imeta ls -d ' + filename, 'STDOUT_SINGLELINE', 'None')
+
+                rule = """
+{
+    "policy_to_invoke" : "irods_policy_execute_rule",
+    "parameters" : {
+        "policy_to_invoke" : "irods_policy_query_processor",
+        "parameters" : {
+              "query_string" : "SELECT USER_NAME, COLL_NAME, DATA_NAME, RESC_NAME WHERE COLL_NAME = '/tempZone/home/rods' AND DATA_NAME = 'test_put_file'",
+              "query_limit" : 1,
+              "query_type" : "general",
+              "number_of_threads" : 1,
+              "dry_run" : "true",
+              "policies_to_invoke" : [
+                  {
+                      "policy_to_invoke" : "irods_policy_testing_policy",
+                      "configuration" : {
+                      }
+                  }
+              ]
+         }
+    }
+}
+INPUT null
+OUTPUT ruleExecOut"""
+
+                rule_file = tempfile.NamedTemporaryFile(mode='wt', dir='/tmp', delete=False).name + '.r'
+                with open(rule_file, 'w') as f:
+                    f.write(rule)
+
+                with query_processor_configured():
+                    admin_session.assert_icommand(['irule', '-r', 'irods_rule_engine_plugin-cpp_default_policy-instance', '-F', rule_file], 'STDOUT_SINGLELINE', 'projected_rows')
+                    admin_session.assert_icommand('imeta ls -d ' + filename, 'STDOUT_SINGLELINE', 'None')
+            finally:
+                admin_session.assert_icommand('irm -f ' + filename)
+                admin_session.assert_icommand('iadmin rum')
+
+    def test_query_invocation_with_dedupe_on(self):
+        with session.make_session_for_existing_admin() as admin_session:
+            try:
+                filename = 'test_put_file'
+                lib.create_local_testfile(filename)
+                admin_session.assert_icommand('iput ' + filename)
+                admin_session.assert_icommand('ils -l', 'STDOUT_SINGLELINE', filename)
+                admin_session.assert_icommand('imeta ls -d ' + filename, 'STDOUT_SINGLELINE', 'None')
+
+                rule = """
+{
+    "policy_to_invoke" : "irods_policy_execute_rule",
+    "parameters" : {
+        "policy_to_invoke" : "irods_policy_query_processor",
+        "parameters" : {
+              "query_string" : "SELECT USER_NAME, COLL_NAME, DATA_NAME, RESC_NAME WHERE COLL_NAME = '/tempZone/home/rods' AND DATA_NAME = 'test_put_file'",
+              "query_type" : "general",
+              "number_of_threads" : 4,
+              "dedupe_on" : [1, 2],
+              "group_rows" : "true",
+              "policies_to_invoke" : [
+                  {
+                      "policy_to_invoke" : "irods_policy_testing_policy",
+                      "configuration" : {
+                      }
+                  }
+              ]
+         }
+    }
+}
+INPUT null
+OUTPUT ruleExecOut"""
+
+                rule_file = tempfile.NamedTemporaryFile(mode='wt', dir='/tmp', delete=False).name + '.r'
+                with open(rule_file, 'w') as f:
+                    f.write(rule)
+
+                with query_processor_configured():
+                    admin_session.assert_icommand(['irule', '-r', 'irods_rule_engine_plugin-cpp_default_policy-instance', '-F', rule_file], 'STDOUT_SINGLELINE', 'usage')
+                    admin_session.assert_icommand('imeta ls -d ' + filename, 'STDOUT_SINGLELINE', 'irods_policy_testing_policy')
+            finally:
+                admin_session.assert_icommand('irm -f ' + filename)
+                admin_session.assert_icommand('iadmin rum')
+
+    def test_query_invocation_fail_with_retry_and_error_report(self):
+        report_file = '/tmp/test_query_processor_error_report.jsonl'
+        with session.make_session_for_existing_admin() as admin_session:
+            try:
+                filename = 'test_put_file'
+                lib.create_local_testfile(filename)
+                admin_session.assert_icommand('iput ' + filename)
+                admin_session.assert_icommand('ils -l', 'STDOUT_SINGLELINE', filename)
+
+                # verification which fails on a replica existing on AnotherResc
+                rule = """
+{
+    "policy_to_invoke" : "irods_policy_execute_rule",
+    "parameters" : {
+        "policy_to_invoke" : "irods_policy_query_processor",
+        "parameters" : {
+              "query_string" : "SELECT USER_NAME, COLL_NAME, DATA_NAME, RESC_NAME WHERE COLL_NAME = '/tempZone/home/rods' AND DATA_NAME = 'test_put_file'",
+              "query_limit" : 1,
+              "query_type" : "general",
+              "number_of_threads" : 1,
+              "retry_attempts" : 2,
+              "retry_backoff_ms" : 100,
+              "error_report_file" : "%s",
+              "policies_to_invoke" : [
+                  {
+                      "policy_to_invoke" : "irods_policy_data_verification",
+                      "parameters" : {
+                          "source_resource" : "AnotherResc"
+                      },
+                      "configuration" : {
+                      }
+                  }
+              ]
+         }
+    }
+}
+INPUT null
+OUTPUT ruleExecOut""" % os.path.basename(report_file)
+
+                rule_file = tempfile.NamedTemporaryFile(mode='wt', dir='/tmp', delete=False).name + '.r'
+                with open(rule_file, 'w') as f:
+                    f.write(rule)
+
+                with query_processor_configured():
+                    admin_session.assert_icommand(['irule', '-r', 'irods_rule_engine_plugin-cpp_default_policy-instance', '-F', rule_file])
+
+                    with open(report_file, 'r') as f:
+                        report = f.read()
+
+                    assert 'irods_policy_data_verification' in report
+                    assert 'test_put_file' in report
+
+                    # the report is replaced by each run rather than appended to
+                    admin_session.assert_icommand(['irule', '-r', 'irods_rule_engine_plugin-cpp_default_policy-instance', '-F', rule_file])
+
+                    with open(report_file, 'r') as f:
+                        assert len(f.read().splitlines()) == len(report.splitlines())
+            finally:
+                if os.path.exists(report_file):
+                    os.remove(report_file)
+                admin_session.assert_icommand('irm -f ' + filename)
+                admin_session.assert_icommand('iadmin rum')
+
+    def test_query_invocation_with_sink(self):
+        sink_file = '/tmp/test_query_processor_sink.csv'
+        with session.make_session_for_existing_admin() as admin_session:
+            try:
+                filename = 'test_put_file'
+                lib.create_local_testfile(filename)
+                admin_session.assert_icommand('iput ' + filename)
+                admin_session.assert_icommand('ils -l', 'STDOUT_SINGLELINE', filename)
+
+                rule = """
+{
+    "policy_to_invoke" : "irods_policy_execute_rule",
+    "parameters" : {
+        "policy_to_invoke" : "irods_policy_query_processor",
+        "parameters" : {
+              "query_string" : "SELECT COLL_NAME, DATA_NAME, RESC_NAME WHERE COLL_NAME = '/tempZone/home/rods' AND DATA_NAME = 'test_put_file'",
+              "query_type" : "general",
+              "number_of_threads" : 1,
+              "sink" : {
+                  "path" : "%s",
+                  "format" : "csv"
+              }
+         }
+    }
+}
+INPUT null
+OUTPUT ruleExecOut""" % os.path.basename(sink_file)
+
+                rule_file = tempfile.NamedTemporaryFile(mode='wt', dir='/tmp', delete=False).name + '.r'
+                with open(rule_file, 'w') as f:
+                    f.write(rule)
+
+                with query_processor_configured():
+                    admin_session.assert_icommand(['irule', '-r', 'irods_rule_engine_plugin-cpp_default_policy-instance', '-F', rule_file], 'STDOUT_SINGLELINE', 'wrote [1] rows')
+
+                with open(sink_file, 'r') as f:
+                    lines = f.read().splitlines()
+
+                assert lines[0] == 'COLL_NAME,DATA_NAME,RESC_NAME'
+                assert lines[1].startswith('/tempZone/home/rods,test_put_file,')
+            finally:
+                if os.path.exists(sink_file):
+                    os.remove(sink_file)
+                admin_session.assert_icommand('irm -f ' + filename)
+                admin_session.assert_icommand('iadmin rum')
+
+    def test_query_invocation_with_sink_outside_report_directory(self):
+        with session.make_session_for_existing_admin() as admin_session:
+            for sink_path in ['/tmp/test_query_processor_sink.csv', '../test_query_processor_sink.csv']:
+                rule = """
+{
+    "policy_to_invoke" : "irods_policy_execute_rule",
+    "parameters" : {
+        "policy_to_invoke" : "irods_policy_query_processor",
+        "parameters" : {
+              "query_string" : "SELECT COLL_NAME, DATA_NAME WHERE COLL_NAME = '/tempZone/home/rods'",
+              "query_type" : "general",
+              "number_of_threads" : 1,
+              "sink" : {
+                  "path" : "%s"
+              }
+         }
+    }
+}
+INPUT null
+OUTPUT ruleExecOut""" % sink_path
+
+                rule_file = tempfile.NamedTemporaryFile(mode='wt', dir='/tmp', delete=False).name + '.r'
+                with open(rule_file, 'w') as f:
+                    f.write(rule)
+
+                with query_processor_configured():
+                    admin_session.assert_icommand(['irule', '-r', 'irods_rule_engine_plugin-cpp_default_policy-instance', '-F', rule_file], 'STDERR_SINGLELINE', 'SYS_INVALID_INPUT_PARAM')
+
+                assert not os.path.exists('/tmp/test_query_processor_sink.csv')
+                assert not os.path.exists('/test_query_processor_sink.csv')
+
+    def test_query_invocation_with_policy_chain(self):
+        with session.make_session_for_existing_admin() as admin_session:
+            try:
+                filename = 'test_put_file'
+                lib.create_local_testfile(filename)
+                admin_session.assert_icommand('iput ' + filename)
+                admin_session.assert_icommand('ils -l', 'STDOUT_SINGLELINE', filename)
+                admin_session.assert_icommand('imeta ls -d ' + filename, 'STDOUT_SINGLELINE', 'None')
+
+                rule = """
+{
+    "policy_to_invoke" : "irods_policy_execute_rule",
+    "parameters" : {
+        "policy_to_invoke" : "irods_policy_query_processor",
+        "parameters" : {
+              "query_string" : "SELECT USER_NAME, COLL_NAME, DATA_NAME, RESC_NAME WHERE COLL_NAME = '/tempZone/home/rods' AND DATA_NAME = 'test_put_file'",
+              "query_limit" : 1,
+              "query_type" : "general",
+              "number_of_threads" : 1,
+              "policies_to_invoke" : [
+                  {
+                      "name" : "second",
+                      "depends_on" : ["first"],
+                      "policy_to_invoke" : "irods_policy_access_time",
+                      "configuration" : {
+                      }
+                  },
+                  {
+                      "name" : "first",
+                      "policy_to_invoke" : "irods_policy_testing_policy",
+                      "configuration" : {
+                      }
+                  }
+              ]
+         }
+    }
+}
+INPUT null
+OUTPUT ruleExecOut"""
+
+                rule_file = tempfile.NamedTemporaryFile(mode='wt', dir='/tmp', delete=False).name + '.r'
+                with open(rule_file, 'w') as f:
+                    f.write(rule)
+
+                with query_processor_configured():
+                    admin_session.assert_icommand(['irule', '-r', 'irods_rule_engine_plugin-cpp_default_policy-instance', '-F', rule_file], 'STDOUT_SINGLELINE', 'usage')
+                    admin_session.assert_icommand('imeta ls -d ' + filename, 'STDOUT_SINGLELINE', 'irods_policy_testing_policy')
+                    admin_session.assert_icommand('imeta ls -d ' + filename, 'STDOUT_SINGLELINE', 'irods::access_time')
+            finally:
+                admin_session.assert_icommand('irm -f ' + filename)
+                admin_session.assert_icommand('iadmin rum')
@@ -123,3 +123,40 @@ OUTPUT ruleExecOut
                 admin_session.assert_icommand('irm -f ' + 'file0')
                 print('annnnd... were done\n')
 
+    def test_verify_checksum_dry_run(self):
+        with session.make_session_for_existing_admin() as admin_session:
+            try:
+                rule = """
+{
+    "policy_to_invoke" : "irods_policy_execute_rule",
+    "parameters" : {
+        "policy_to_invoke"    : "irods_policy_verify_checksum",
+        "parameters" : {
+            "logical_path" : "/tempZone/home/rods/file0",
+            "source_resource" : "demoResc",
+            "dry_run" : "true"
+        }
+    }
+}
+INPUT null
+OUTPUT ruleExecOut
+"""
+
+                rule_file = tempfile.NamedTemporaryFile(mode='wt', dir='/tmp', delete=False).name + '.r'
+                with open(rule_file, 'w') as f:
+                    f.write(rule)
+
+                admin_session.assert_icommand(['iput', '-fK', rule_file, 'file0'])
+
+                # a mismatch is not detected as the replica is not read
+                with open('/var/lib/irods/Vault/home/rods/file0', 'w') as f:
+                    f.write('X')
+
+                with filesystem_usage_configured():
+                    out, err, ec = admin_session.run_icommand(['irule', '-r', 'irods_rule_engine_plugin-cpp_default_policy-instance', '-F', rule_file])
+                    lib.log_command_result('irule', out, err, ec)
+                    assert(out.find('dry_run') != -1)
+                    assert(out.find('computed_checksum') == -1)
+
+            finally:
+                admin_session.assert_icommand('irm -f ' + 'file0')
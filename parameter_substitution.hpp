@@ -26,6 +26,7 @@ namespace irods::policy_composition::policy_engine {
             static const std::string destination_resource{"IRODS_TOKEN_DESTINATION_RESOURCE_END_TOKEN"};
             static const std::string source_leaf_bundle{"IRODS_TOKEN_SOURCE_RESOURCE_LEAF_BUNDLE_END_TOKEN"};
             static const std::string destination_leaf_bundle{"IRODS_TOKEN_DESTINATION_RESOURCE_LEAF_BUNDLE_END_TOKEN"};
+            static const std::string last_run_time{"IRODS_TOKEN_LAST_RUN_TIME_END_TOKEN"};
             static std::map<std::string, uint32_t> index_map = {
                 {current_time, 0}
               , {lifetime, 1}
@@ -36,6 +37,7 @@ namespace irods::policy_composition::policy_engine {
               , {destination_resource, 6}
               , {source_leaf_bundle, 5}
               , {destination_leaf_bundle, 6}
+              , {last_run_time, 7}
             };
     }; // tokens
 
@@ -119,7 +121,7 @@ namespace irods::policy_composition::policy_engine {
                     }
 
                     auto tok = query_string.substr(start, (end+suffix.size())-start);
-                    auto val = values[tokens::index_map.at(tok)];
+                    auto val = values.at(tokens::index_map.at(tok));
 
                     std::string tmp{val};
                     if(tokens::source_leaf_bundle == tok ||
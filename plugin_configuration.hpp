@@ -0,0 +1,35 @@
+#ifndef IRODS_POLICY_ENGINE_PLUGIN_CONFIGURATION_HPP
+#define IRODS_POLICY_ENGINE_PLUGIN_CONFIGURATION_HPP
+
+#include <irods/irods_configuration_keywords.hpp>
+#include <irods/irods_server_properties.hpp>
+
+#include <nlohmann/json.hpp>
+
+#include <string>
+
+namespace irods::policy_composition::policy_engine {
+
+    // the plugin_specific_configuration of a rule engine instance as written within
+    // server_config.json.  unlike the configuration of an invocation it cannot be
+    // supplied by a client, settings naming local files are only read from here
+    auto read_plugin_specific_configuration(const std::string& _instance_name) -> nlohmann::json
+    {
+        const auto& rule_engines = irods::get_server_property<const nlohmann::json&>(
+                                       irods::configuration_parser::key_path_t{
+                                           irods::KW_CFG_PLUGIN_CONFIGURATION,
+                                           irods::KW_CFG_PLUGIN_TYPE_RULE_ENGINE});
+
+        for(const auto& re : rule_engines) {
+            if(re.value(irods::KW_CFG_INSTANCE_NAME, std::string{}) == _instance_name) {
+                return re.value(irods::KW_CFG_PLUGIN_SPECIFIC_CONFIGURATION, nlohmann::json::object());
+            }
+        }
+
+        return nlohmann::json::object();
+
+    } // read_plugin_specific_configuration
+
+} // namespace irods::policy_composition::policy_engine
+
+#endif // IRODS_POLICY_ENGINE_PLUGIN_CONFIGURATION_HPP
@@ -22,6 +22,7 @@ add_library(
     ${TARGET_NAME}
     MODULE
     ${CMAKE_SOURCE_DIR}/lib${TARGET_NAME}.cpp
+    ${CMAKE_SOURCE_DIR}/${POLICY_NAME}_utilities.cpp
     )
 
 target_include_directories(
@@ -38,10 +39,12 @@ target_link_libraries(
     ${IRODS_PLUGIN_POLICY_LINK_LIBRARIES}
     irods_common
     irods_dev_policy_composition_framework
+    ${IRODS_EXTERNALS_FULLPATH_BOOST}/lib/libboost_filesystem.so
     ${IRODS_EXTERNALS_FULLPATH_BOOST}/lib/libboost_system.so
     ${IRODS_EXTERNALS_FULLPATH_BOOST}/lib/libboost_thread.so
     fmt::fmt
     nlohmann_json::nlohmann_json
+    ZLIB::ZLIB
     pthread
     )
 
@@ -0,0 +1,732 @@
+#define IRODS_QUERY_ENABLE_SERVER_SIDE_API
+#include <irods/irods_query.hpp>
+#include <irods/rodsLog.h>
+#include <irods/irods_exception.hpp>
+#include <irods/rsModAVUMetadata.hpp>
+
+#include <boost/algorithm/string.hpp>
+#include <boost/filesystem.hpp>
+#include <nlohmann/json.hpp>
+#include <fmt/format.h>
+
+#include <zlib.h>
+
+#include <algorithm>
+#include <cmath>
+#include <cstdio>
+#include <fstream>
+
+#include "query_processor_utilities.hpp"
+
+namespace {
+
+    const std::string watermark_attribute_prefix{"irods::query_processor::watermark::"};
+
+    // quotes a CSV field if it contains a delimiter, quote or line break
+    auto escape_csv_field(const std::string& _field) -> std::string
+    {
+        if(std::string::npos == _field.find_first_of(",\"\r\n")) {
+            return _field;
+        }
+
+        std::string escaped{"\""};
+        for(const auto c : _field) {
+            if('"' == c) {
+                escaped += '"';
+            }
+
+            escaped += c;
+        }
+
+        return escaped + '"';
+
+    } // escape_csv_field
+
+    auto format_csv_line(const std::vector<std::string>& _fields) -> std::string
+    {
+        std::string line{};
+        for(std::size_t i = 0; i < _fields.size(); ++i) {
+            if(i > 0) {
+                line += ',';
+            }
+
+            line += escape_csv_field(_fields[i]);
+        }
+
+        return line + '\n';
+
+    } // format_csv_line
+
+    // a window with more errors than this fraction halves the limit
+    const double maximum_error_rate{0.1};
+
+    // a window whose mean latency exceeds the baseline by this factor backs off
+    const double latency_saturation_factor{2.0};
+
+} // namespace
+
+namespace irods {
+
+    adaptive_concurrency::adaptive_concurrency(
+          const std::string& _policy_name
+        , uint32_t           _minimum
+        , uint32_t           _maximum
+        , uint32_t           _window)
+        : policy_name_{_policy_name}
+        , minimum_{std::max(_minimum, 1u)}
+        , maximum_{std::max(_maximum, std::max(_minimum, 1u))}
+        , window_{std::max(_window, 1u)}
+        , limit_{minimum_}
+    {
+        rodsLog(
+            LOG_NOTICE,
+            "%s :: adaptive number_of_threads enabled, minimum [%u] maximum [%u] window [%u]",
+            policy_name_.c_str(),
+            minimum_,
+            maximum_,
+            window_);
+    } // ctor
+
+    void adaptive_concurrency::acquire()
+    {
+        std::unique_lock lk{mutex_};
+        ++waiting_;
+        cv_.wait(lk, [this] { return active_ < limit_; });
+        --waiting_;
+        ++active_;
+    } // acquire
+
+    void adaptive_concurrency::release(std::chrono::microseconds _latency, bool _error)
+    {
+        std::lock_guard lk{mutex_};
+        --active_;
+
+        ++samples_;
+        total_latency_ += _latency;
+        if(_error) {
+            ++errors_;
+        }
+
+        if(samples_ >= window_) {
+            adjust();
+        }
+
+        cv_.notify_all();
+    } // release
+
+    auto adaptive_concurrency::limit() -> uint32_t
+    {
+        std::lock_guard lk{mutex_};
+        return limit_;
+    } // limit
+
+    // mutex_ must be held by the caller
+    void adaptive_concurrency::adjust()
+    {
+        const auto mean_latency = static_cast<double>(total_latency_.count()) / samples_;
+        const auto error_rate   = static_cast<double>(errors_) / samples_;
+        const auto previous     = limit_;
+
+        std::string reason{};
+
+        if(error_rate > maximum_error_rate) {
+            // multiplicative decrease
+            limit_ = std::max(minimum_, limit_ / 2);
+            reason = "error rate";
+        }
+        else if(baseline_latency_ > 0 && mean_latency > baseline_latency_ * latency_saturation_factor) {
+            limit_ = std::max(minimum_, limit_ - std::max(1u, limit_ / 4));
+            reason = "latency";
+        }
+        else if(waiting_ > 0) {
+            // additive increase, only while rows are queued behind the limit
+            limit_ = std::min(maximum_, limit_ + 1);
+            reason = "queue depth";
+        }
+        else {
+            reason = "no backlog";
+        }
+
+        baseline_latency_ = (0 == baseline_latency_ || mean_latency < baseline_latency_)
+                            ? mean_latency
+                            : baseline_latency_ * 0.95 + mean_latency * 0.05;
+
+        rodsLog(
+            previous == limit_ ? LOG_DEBUG : LOG_NOTICE,
+            "%s :: adaptive number_of_threads [%u] -> [%u] (%s) mean latency [%.3f] ms error rate [%.2f] waiting rows [%u]",
+            policy_name_.c_str(),
+            previous,
+            limit_,
+            reason.c_str(),
+            mean_latency / 1000.0,
+            error_rate,
+            waiting_);
+
+        samples_       = 0;
+        errors_        = 0;
+        total_latency_ = std::chrono::microseconds{};
+
+    } // adjust
+
+    affinity_scheduler::affinity_scheduler(
+          uint32_t _column
+        , uint32_t _maximum_per_key
+        , uint32_t _maximum_buffered)
+        : column_{_column}
+        , maximum_per_key_{std::max(_maximum_per_key, 1u)}
+        , maximum_buffered_{std::max(_maximum_buffered, 1u)}
+    {
+    } // ctor
+
+    void affinity_scheduler::push(const row_type& _row)
+    {
+        const auto key = column_ < _row.size() ? _row[column_] : std::string{};
+
+        std::unique_lock lk{mutex_};
+        cv_.wait(lk, [this] { return buffered_ < maximum_buffered_; });
+
+        auto [it, inserted] = queues_.try_emplace(key);
+        if(inserted) {
+            keys_.push_back(key);
+        }
+
+        it->second.rows.push_back(_row);
+        ++buffered_;
+
+        cv_.notify_all();
+    } // push
+
+    void affinity_scheduler::close()
+    {
+        std::lock_guard lk{mutex_};
+        closed_ = true;
+        cv_.notify_all();
+    } // close
+
+    auto affinity_scheduler::pop(uint32_t _worker, row_type& _row, std::string& _key) -> bool
+    {
+        std::unique_lock lk{mutex_};
+
+        while(true) {
+            const auto n = keys_.size();
+            for(std::size_t i = 0; i < n; ++i) {
+                const auto& k = keys_[(_worker + i) % n];
+                auto&       q = queues_.at(k);
+                if(q.rows.empty() || q.active >= maximum_per_key_) {
+                    continue;
+                }
+
+                _row = std::move(q.rows.front());
+                _key = k;
+                q.rows.pop_front();
+                ++q.active;
+                --buffered_;
+
+                // wake a producer waiting on the buffer limit
+                cv_.notify_all();
+                return true;
+            }
+
+            if(closed_ && 0 == buffered_) {
+                return false;
+            }
+
+            cv_.wait(lk);
+        }
+    } // pop
+
+    void affinity_scheduler::done(const std::string& _key)
+    {
+        std::lock_guard lk{mutex_};
+        --queues_.at(_key).active;
+        cv_.notify_all();
+    } // done
+
+    auto parse_selected_columns(const std::string& _query_string) -> std::vector<std::string>
+    {
+        const std::string select{"select"};
+        const std::string where{" where "};
+
+        auto begin = boost::algorithm::ifind_first(_query_string, select);
+        if(begin.empty()) {
+            THROW(SYS_INVALID_INPUT_PARAM,
+                  fmt::format("missing select clause in query [{}]", _query_string));
+        }
+
+        auto end = boost::algorithm::ifind_first(_query_string, where);
+        const auto clause = std::string{begin.end(), end.empty() ? _query_string.end() : end.begin()};
+
+        std::vector<std::string> columns{};
+        boost::algorithm::split(columns, clause, boost::is_any_of(","));
+        for(auto& c : columns) {
+            boost::algorithm::trim(c);
+        }
+
+        return columns;
+
+    } // parse_selected_columns
+
+    auto get_column_index(const std::string& _query_string, const std::string& _column) -> uint32_t
+    {
+        const auto columns = parse_selected_columns(_query_string);
+        for(std::size_t i = 0; i < columns.size(); ++i) {
+            if(boost::algorithm::iequals(columns[i], _column)) {
+                return i;
+            }
+        }
+
+        THROW(SYS_INVALID_INPUT_PARAM,
+              fmt::format("column [{}] is not selected by query [{}]", _column, _query_string));
+
+    } // get_column_index
+
+    row_deduplicator::row_deduplicator(const std::vector<uint32_t>& _columns, bool _group)
+        : columns_{_columns}
+        , group_{_group}
+    {
+    } // ctor
+
+    // FNV-1a over the key columns, each terminated by a separator which may not
+    // appear within a catalog value
+    auto row_deduplicator::key(const row_type& _row) const -> uint64_t
+    {
+        uint64_t hash{14695981039346656037ull};
+
+        auto mix = [&hash](unsigned char _c) {
+            hash ^= _c;
+            hash *= 1099511628211ull;
+        };
+
+        for(const auto c : columns_) {
+            if(c < _row.size()) {
+                for(const auto ch : _row[c]) {
+                    mix(static_cast<unsigned char>(ch));
+                }
+            }
+
+            mix('\0');
+        }
+
+        return hash;
+
+    } // key
+
+    auto row_deduplicator::insert(const row_type& _row) -> bool
+    {
+        const auto k = key(_row);
+
+        std::lock_guard lk{mutex_};
+
+        const auto inserted = keys_.insert(k).second;
+
+        if(group_) {
+            auto& g = groups_[k];
+            g.resize(std::max(g.size(), _row.size()));
+            for(std::size_t i = 0; i < _row.size(); ++i) {
+                g[i].push_back(_row[i]);
+            }
+
+            if(inserted) {
+                first_rows_.push_back(_row);
+            }
+        }
+
+        return inserted;
+
+    } // insert
+
+    auto row_deduplicator::first_rows() -> std::vector<row_type>
+    {
+        std::lock_guard lk{mutex_};
+        return first_rows_;
+    } // first_rows
+
+    auto row_deduplicator::group(const row_type& _row) -> std::vector<std::vector<std::string>>
+    {
+        const auto k = key(_row);
+
+        std::lock_guard lk{mutex_};
+        const auto it = groups_.find(k);
+        return groups_.end() == it ? std::vector<std::vector<std::string>>{} : it->second;
+    } // group
+
+    row_sink::row_sink(
+          const std::string&              _path
+        , const std::string&              _format
+        , const std::string&              _compression
+        , const std::vector<std::string>& _columns
+        , std::size_t                     _chunk_size)
+        : path_{_path}
+        , csv_{"csv" == _format}
+        , gzip_{"gzip" == _compression}
+        , columns_{_columns}
+        , chunk_size_{std::max<std::size_t>(_chunk_size, 4096)}
+    {
+        if("csv" != _format && "jsonl" != _format) {
+            THROW(SYS_INVALID_INPUT_PARAM, fmt::format("unsupported sink format [{}]", _format));
+        }
+
+        if(!_compression.empty() && "none" != _compression && !gzip_) {
+            THROW(SYS_INVALID_INPUT_PARAM, fmt::format("unsupported sink compression [{}]", _compression));
+        }
+
+        file_ = gzip_
+                ? static_cast<void*>(gzopen(path_.c_str(), "wb"))
+                : static_cast<void*>(std::fopen(path_.c_str(), "wb"));
+        if(!file_) {
+            THROW(FILE_OPEN_ERR, fmt::format("failed to open sink [{}]", path_));
+        }
+
+        buffer_.reserve(chunk_size_);
+
+        if(csv_ && !columns_.empty()) {
+            buffer_ += format_csv_line(columns_);
+        }
+    } // ctor
+
+    row_sink::~row_sink()
+    {
+        try {
+            close();
+        }
+        catch(const irods::exception& e) {
+            rodsLog(LOG_ERROR, "%s", e.client_display_what());
+        }
+    } // dtor
+
+    void row_sink::write(const row_type& _row)
+    {
+        std::string line{};
+        if(csv_) {
+            line = format_csv_line(_row);
+        }
+        else if(columns_.size() == _row.size()) {
+            auto obj = nlohmann::json::object();
+            for(std::size_t i = 0; i < _row.size(); ++i) {
+                obj[columns_[i]] = _row[i];
+            }
+
+            line = obj.dump() + '\n';
+        }
+        else {
+            line = nlohmann::json(_row).dump() + '\n';
+        }
+
+        std::lock_guard lk{mutex_};
+        buffer_ += line;
+        ++rows_;
+
+        if(buffer_.size() >= chunk_size_) {
+            flush();
+        }
+    } // write
+
+    auto row_sink::close() -> uint64_t
+    {
+        std::lock_guard lk{mutex_};
+        if(!file_) {
+            return rows_;
+        }
+
+        flush();
+
+        const auto ret = gzip_
+                         ? gzclose(static_cast<gzFile>(file_))
+                         : std::fclose(static_cast<std::FILE*>(file_));
+        file_ = nullptr;
+
+        if(0 != ret) {
+            THROW(FILE_WRITE_ERR, fmt::format("failed to close sink [{}]", path_));
+        }
+
+        return rows_;
+
+    } // close
+
+    // mutex_ must be held by the caller
+    void row_sink::flush()
+    {
+        if(buffer_.empty()) {
+            return;
+        }
+
+        const auto written = gzip_
+                             ? static_cast<std::size_t>(std::max(0, gzwrite(static_cast<gzFile>(file_), buffer_.data(), buffer_.size())))
+                             : std::fwrite(buffer_.data(), 1, buffer_.size(), static_cast<std::FILE*>(file_));
+
+        if(written != buffer_.size()) {
+            THROW(FILE_WRITE_ERR, fmt::format("failed to write [{}] bytes to sink [{}]", buffer_.size(), path_));
+        }
+
+        buffer_.clear();
+
+    } // flush
+
+    void watermark_tracker::observe(const std::string& _value)
+    {
+        long long numeric{};
+        try {
+            numeric = std::stoll(_value);
+        }
+        catch(const std::exception&) {
+            return;
+        }
+
+        std::lock_guard lk{mutex_};
+        if(value_.empty() || numeric > numeric_) {
+            value_   = _value;
+            numeric_ = numeric;
+        }
+    } // observe
+
+    auto watermark_tracker::value() -> std::string
+    {
+        std::lock_guard lk{mutex_};
+        return value_;
+    } // value
+
+    auto get_watermark(
+          rsComm_t&          _comm
+        , const std::string& _collection
+        , const std::string& _name) -> std::string
+    {
+        const auto query_str = fmt::format(
+                               "SELECT META_COLL_ATTR_VALUE WHERE COLL_NAME = '{}' AND META_COLL_ATTR_NAME = '{}{}'"
+                               , _collection
+                               , watermark_attribute_prefix
+                               , _name);
+
+        irods::query<rsComm_t> qobj{&_comm, query_str, 1};
+
+        return qobj.size() > 0 ? qobj.front()[0] : std::string{"0"};
+
+    } // get_watermark
+
+    auto set_watermark(
+          rsComm_t&          _comm
+        , const std::string& _collection
+        , const std::string& _name
+        , const std::string& _value) -> int
+    {
+        const auto attribute = watermark_attribute_prefix + _name;
+
+        modAVUMetadataInp_t set_op{};
+        set_op.arg0 = const_cast<char*>("set");
+        set_op.arg1 = const_cast<char*>("-C");
+        set_op.arg2 = const_cast<char*>(_collection.c_str());
+        set_op.arg3 = const_cast<char*>(attribute.c_str());
+        set_op.arg4 = const_cast<char*>(_value.c_str());
+
+        return rsModAVUMetadata(&_comm, &set_op);
+
+    } // set_watermark
+
+    void create_error_report(const std::string& _path)
+    {
+        std::ofstream report{_path, std::ios::trunc};
+        if(!report) {
+            THROW(FILE_OPEN_ERR, fmt::format("failed to create error report [{}]", _path));
+        }
+    } // create_error_report
+
+    void write_error_report(const std::string& _path, const std::vector<row_failure>& _failures)
+    {
+        std::ofstream report{_path, std::ios::app};
+        if(!report) {
+            THROW(FILE_OPEN_ERR, fmt::format("failed to open error report [{}]", _path));
+        }
+
+        for(const auto& f : _failures) {
+            report << nlohmann::json{
+                          {"row",        f.row}
+                        , {"policy",     f.policy}
+                        , {"error_code", f.code}
+                        , {"message",    f.message}}.dump() << '\n';
+        }
+
+    } // write_error_report
+
+    auto resolve_local_path(const std::string& _directory, const std::string& _path) -> std::string
+    {
+        namespace bfs = boost::filesystem;
+
+        if(_directory.empty()) {
+            THROW(SYS_INVALID_INPUT_PARAM, fmt::format("no report_directory is configured for [{}]", _path));
+        }
+
+        const bfs::path path{_path};
+        if(path.empty() || path.is_absolute()) {
+            THROW(SYS_INVALID_INPUT_PARAM, fmt::format("path [{}] must be relative to [{}]", _path, _directory));
+        }
+
+        try {
+            // symbolic links and .. are resolved before the path is compared
+            const auto directory = bfs::canonical(_directory);
+            const auto resolved  = bfs::weakly_canonical(directory / path);
+
+            auto d = directory.begin();
+            auto r = resolved.begin();
+            for(; d != directory.end(); ++d, ++r) {
+                if(r == resolved.end() || *d != *r) {
+                    break;
+                }
+            }
+
+            if(d != directory.end() || r == resolved.end()) {
+                THROW(SYS_INVALID_INPUT_PARAM, fmt::format("path [{}] is not within [{}]", _path, _directory));
+            }
+
+            return resolved.string();
+        }
+        catch(const bfs::filesystem_error& e) {
+            THROW(SYS_INVALID_INPUT_PARAM, fmt::format("failed to resolve [{}] within [{}] - {}", _path, _directory, e.what()));
+        }
+
+    } // resolve_local_path
+
+    auto get_policy_name(const nlohmann::json& _policies, uint32_t _index) -> std::string
+    {
+        const auto& p = _policies.at(_index);
+        return p.contains("name")
+               ? p.at("name").get<std::string>()
+               : p.at("policy_to_invoke").get<std::string>();
+    } // get_policy_name
+
+    auto get_policy_dependencies(const nlohmann::json& _policies, uint32_t _index) -> std::vector<uint32_t>
+    {
+        std::vector<uint32_t> dependencies{};
+
+        const auto& p = _policies.at(_index);
+        if(!p.contains("depends_on")) {
+            return dependencies;
+        }
+
+        for(const auto& d : p.at("depends_on")) {
+            const auto name = d.get<std::string>();
+
+            uint32_t i = 0;
+            while(i < _policies.size() && get_policy_name(_policies, i) != name) {
+                ++i;
+            }
+
+            if(_policies.size() == i) {
+                THROW(SYS_INVALID_INPUT_PARAM,
+                      fmt::format("policy [{}] depends on unknown policy [{}]", get_policy_name(_policies, _index), name));
+            }
+
+            dependencies.push_back(i);
+        }
+
+        return dependencies;
+
+    } // get_policy_dependencies
+
+    auto compute_policy_levels(const nlohmann::json& _policies) -> std::vector<std::vector<uint32_t>>
+    {
+        const auto n = static_cast<uint32_t>(_policies.size());
+
+        for(uint32_t i = 0; i < n; ++i) {
+            for(uint32_t j = i + 1; j < n; ++j) {
+                if(get_policy_name(_policies, i) == get_policy_name(_policies, j) &&
+                   (_policies.at(i).contains("name") || _policies.at(j).contains("name"))) {
+                    THROW(SYS_INVALID_INPUT_PARAM,
+                          fmt::format("duplicate policy name [{}]", get_policy_name(_policies, i)));
+                }
+            }
+        }
+
+        std::vector<int> level_of(n, -1);
+        std::vector<std::vector<uint32_t>> levels{};
+
+        for(uint32_t placed = 0; placed < n;) {
+            std::vector<uint32_t> level{};
+            for(uint32_t i = 0; i < n; ++i) {
+                if(level_of[i] >= 0) {
+                    continue;
+                }
+
+                const auto deps = get_policy_dependencies(_policies, i);
+                const auto ready = std::all_of(deps.begin(), deps.end(), [&](auto d) {
+                    return level_of[d] >= 0 && level_of[d] < static_cast<int>(levels.size()); });
+
+                if(ready) {
+                    level.push_back(i);
+                }
+            }
+
+            if(level.empty()) {
+                THROW(SYS_INVALID_INPUT_PARAM, "policies_to_invoke contains a dependency cycle");
+            }
+
+            for(const auto i : level) {
+                level_of[i] = static_cast<int>(levels.size());
+            }
+
+            placed += level.size();
+            levels.push_back(std::move(level));
+        }
+
+        return levels;
+
+    } // compute_policy_levels
+
+    auto count_query_rows(
+          rsComm_t&          _comm
+        , const std::string& _query_string
+        , const std::string& _query_type) -> uint64_t
+    {
+        using query = irods::query<rsComm_t>;
+
+        const auto type = query::convert_string_to_query_type(_query_type);
+
+        if(query::GENERAL != type) {
+            uint64_t count{};
+            query qobj{&_comm, _query_string, 0, 0, type};
+            for(const auto& row : qobj) {
+                static_cast<void>(row);
+                ++count;
+            }
+
+            return count;
+        }
+
+        // strip any aggregation or ordering from the first column, e.g. ORDER(DATA_NAME)
+        auto column = parse_selected_columns(_query_string).front();
+        const auto open  = column.find('(');
+        const auto close = column.rfind(')');
+        if(std::string::npos != open && std::string::npos != close && close > open) {
+            column = column.substr(open + 1, close - open - 1);
+        }
+
+        const auto where = boost::algorithm::ifind_first(_query_string, " where ");
+        const auto count_query_string = fmt::format(
+                                            "SELECT COUNT({}){}"
+                                            , column
+                                            , where.empty()
+                                              ? std::string{}
+                                              : std::string{where.begin(), _query_string.end()});
+
+        query qobj{&_comm, count_query_string, 1};
+        if(0 == qobj.size()) {
+            return 0;
+        }
+
+        return std::stoull(qobj.front()[0]);
+
+    } // count_query_rows
+
+    auto compute_percentile(std::vector<double> _samples, double _percentile) -> double
+    {
+        if(_samples.empty()) {
+            return 0.0;
+        }
+
+        std::sort(_samples.begin(), _samples.end());
+
+        const auto rank = static_cast<std::size_t>(std::ceil(_percentile / 100.0 * _samples.size()));
+
+        return _samples[std::clamp<std::size_t>(rank, 1, _samples.size()) - 1];
+
+    } // compute_percentile
+
+} // namespace irods
@@ -0,0 +1,264 @@
+#ifndef IRODS_QUERY_PROCESSOR_UTILITIES_HPP
+#define IRODS_QUERY_PROCESSOR_UTILITIES_HPP
+
+#include <irods/rcConnect.h>
+
+#include <nlohmann/json.hpp>
+
+#include <chrono>
+#include <condition_variable>
+#include <cstdint>
+#include <deque>
+#include <map>
+#include <mutex>
+#include <string>
+#include <unordered_map>
+#include <unordered_set>
+#include <vector>
+
+namespace irods {
+
+    // limits the number of rows processed concurrently by the query processor,
+    // the limit is adjusted within [minimum, maximum] by an AIMD controller which
+    // samples per-row latency, error rate and the number of rows waiting for a slot
+    class adaptive_concurrency {
+    public:
+        adaptive_concurrency(
+              const std::string& _policy_name
+            , uint32_t           _minimum
+            , uint32_t           _maximum
+            , uint32_t           _window);
+
+        // blocks until the number of active rows is below the current limit
+        void acquire();
+
+        // returns a slot and records the observed latency and outcome for the row
+        void release(std::chrono::microseconds _latency, bool _error);
+
+        auto limit() -> uint32_t;
+
+    private:
+        void adjust();
+
+        const std::string policy_name_;
+        const uint32_t    minimum_;
+        const uint32_t    maximum_;
+        const uint32_t    window_;
+
+        std::mutex              mutex_;
+        std::condition_variable cv_;
+
+        uint32_t limit_;
+        uint32_t active_{};
+        uint32_t waiting_{};
+
+        // statistics for the current window
+        uint32_t                  samples_{};
+        uint32_t                  errors_{};
+        std::chrono::microseconds total_latency_{};
+
+        // slowly decaying lowest mean latency, used to detect saturation
+        double baseline_latency_{};
+
+    }; // class adaptive_concurrency
+
+    // distributes rows into per-key queues, keyed by the value of one column such as
+    // RESC_NAME, and hands them to workers such that no key has more than a fixed
+    // number of rows in flight.  workers prefer their own queue and steal from the
+    // others when it is empty or saturated
+    class affinity_scheduler {
+    public:
+        using row_type = std::vector<std::string>;
+
+        affinity_scheduler(
+              uint32_t _column
+            , uint32_t _maximum_per_key
+            , uint32_t _maximum_buffered);
+
+        // blocks while the number of buffered rows is at the maximum
+        void push(const row_type& _row);
+
+        // no further rows will be pushed, workers drain the queues and return
+        void close();
+
+        // returns false once the scheduler is closed and all queues are empty
+        auto pop(uint32_t _worker, row_type& _row, std::string& _key) -> bool;
+
+        // releases the slot taken by pop for the given key
+        void done(const std::string& _key);
+
+    private:
+        struct queue {
+            std::deque<row_type> rows;
+            uint32_t             active{};
+        };
+
+        const uint32_t column_;
+        const uint32_t maximum_per_key_;
+        const uint32_t maximum_buffered_;
+
+        std::mutex              mutex_;
+        std::condition_variable cv_;
+
+        std::map<std::string, queue> queues_;
+        std::vector<std::string>     keys_;
+        uint32_t                     buffered_{};
+        bool                         closed_{};
+
+    }; // class affinity_scheduler
+
+    // collapses rows which are equal within the key columns, such as the rows for each
+    // replica of a data object.  only a 64 bit hash of the key is kept for each row.
+    // when grouping, the values of every column are collected for each key
+    class row_deduplicator {
+    public:
+        using row_type = std::vector<std::string>;
+
+        row_deduplicator(const std::vector<uint32_t>& _columns, bool _group);
+
+        // returns true for the first row with a given key
+        auto insert(const row_type& _row) -> bool;
+
+        // the first row for each key, in the order in which they were inserted
+        auto first_rows() -> std::vector<row_type>;
+
+        // the values of each column for all rows sharing the key of the given row
+        auto group(const row_type& _row) -> std::vector<std::vector<std::string>>;
+
+    private:
+        auto key(const row_type& _row) const -> uint64_t;
+
+        const std::vector<uint32_t> columns_;
+        const bool                  group_;
+
+        std::mutex                   mutex_;
+        std::unordered_set<uint64_t> keys_;
+        std::vector<row_type>        first_rows_;
+
+        std::unordered_map<uint64_t, std::vector<std::vector<std::string>>> groups_;
+
+    }; // class row_deduplicator
+
+    // streams rows to a local file as JSON lines or CSV, optionally gzip compressed.
+    // rows are formatted into a buffer which is written once it reaches the chunk size
+    class row_sink {
+    public:
+        using row_type = std::vector<std::string>;
+
+        // an empty set of columns writes each row as a JSON array and omits the CSV header
+        row_sink(
+              const std::string&              _path
+            , const std::string&              _format
+            , const std::string&              _compression
+            , const std::vector<std::string>& _columns
+            , std::size_t                     _chunk_size);
+
+        ~row_sink();
+
+        row_sink(const row_sink&) = delete;
+        row_sink& operator=(const row_sink&) = delete;
+
+        void write(const row_type& _row);
+
+        // flushes the buffer and closes the file, returns the number of rows written
+        auto close() -> uint64_t;
+
+    private:
+        void flush();
+
+        const std::string              path_;
+        const bool                     csv_;
+        const bool                     gzip_;
+        const std::vector<std::string> columns_;
+        const std::size_t              chunk_size_;
+
+        std::mutex  mutex_;
+        std::string buffer_;
+        uint64_t    rows_{};
+        void*       file_{};
+
+    }; // class row_sink
+
+    // tracks the greatest numeric value observed within a column, such as
+    // DATA_MODIFY_TIME, preserving the original formatting of the value
+    class watermark_tracker {
+    public:
+        void observe(const std::string& _value);
+
+        // empty if no numeric value was observed
+        auto value() -> std::string;
+
+    private:
+        std::mutex  mutex_;
+        std::string value_{};
+        long long   numeric_{};
+
+    }; // class watermark_tracker
+
+    // returns the stored watermark for a name, or "0" if none has been stored
+    auto get_watermark(
+          rsComm_t&          _comm
+        , const std::string& _collection
+        , const std::string& _name) -> std::string;
+
+    // stores the watermark for a name as metadata on the given collection
+    auto set_watermark(
+          rsComm_t&          _comm
+        , const std::string& _collection
+        , const std::string& _name
+        , const std::string& _value) -> int;
+
+    // a policy invocation which failed for a row of results
+    struct row_failure {
+        std::vector<std::string> row;
+        uint32_t                 policy_index;
+        std::string              policy;
+        int                      code;
+        std::string              message;
+
+        // parameters added to the invocation beyond query_results, as serialized JSON
+        std::string              injected_parameters;
+    };
+
+    // creates or truncates the error report, such that it holds a single run
+    void create_error_report(const std::string& _path);
+
+    // appends one JSON object per failure to a local file
+    void write_error_report(const std::string& _path, const std::vector<row_failure>& _failures);
+
+    // resolves a path given by a client within a directory configured by the
+    // administrator, throwing if the path is absolute or leaves the directory
+    // through .. or a symbolic link
+    auto resolve_local_path(const std::string& _directory, const std::string& _path) -> std::string;
+
+    // returns the "name" of a policy within policies_to_invoke, or its policy_to_invoke
+    auto get_policy_name(const nlohmann::json& _policies, uint32_t _index) -> std::string;
+
+    // returns the indices of the policies named within the "depends_on" of a policy
+    auto get_policy_dependencies(const nlohmann::json& _policies, uint32_t _index) -> std::vector<uint32_t>;
+
+    // orders policies_to_invoke into levels where each policy depends only on those
+    // within earlier levels, throws for an unknown or duplicate name or a cycle
+    auto compute_policy_levels(const nlohmann::json& _policies) -> std::vector<std::vector<uint32_t>>;
+
+    // returns the number of rows a query would produce.  a specific query is paged
+    // through and counted exactly, while a general query is rewritten as a COUNT of its
+    // first column.  the catalog returns the distinct tuples of the selected columns, so
+    // the COUNT of a general query is an estimate which may exceed the rows dispatched
+    auto count_query_rows(
+          rsComm_t&          _comm
+        , const std::string& _query_string
+        , const std::string& _query_type) -> uint64_t;
+
+    // returns the nearest-rank percentile, [0, 100], of the given samples
+    auto compute_percentile(std::vector<double> _samples, double _percentile) -> double;
+
+    // returns the column names of the select clause of a general query
+    auto parse_selected_columns(const std::string& _query_string) -> std::vector<std::string>;
+
+    // returns the position of a column within the select clause of a general query
+    auto get_column_index(const std::string& _query_string, const std::string& _column) -> uint32_t;
+
+} // namespace irods
+
+#endif // IRODS_QUERY_PROCESSOR_UTILITIES_HPP
@@ -0,0 +1,213 @@
+#ifndef IRODS_POLICY_ENGINE_THROTTLE_HPP
+#define IRODS_POLICY_ENGINE_THROTTLE_HPP
+
+#include <irods/rodsType.h>
+
+#include <nlohmann/json.hpp>
+#include <fmt/format.h>
+
+#include <algorithm>
+#include <chrono>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+// Token bucket throttling for the catalog and storage operations issued by a policy.
+// Buckets are shared by all invocations within an agent, which includes every row
+// processed by the query processor, and are configured within the policy configuration:
+//
+// "throttle" : {
+//     "operations_per_second" : 20,
+//     "bytes_per_second"      : 104857600,
+//     "burst_seconds"         : 1,
+//     "resources" : {
+//         "archive_resc" : {
+//             "operations_per_second" : 5,
+//             "bytes_per_second"      : 52428800
+//         }
+//     }
+// }
+//
+// The top level rates apply to the policy as a whole, the rates under "resources"
+// apply to each operation touching that resource.
+
+namespace irods::policy_composition::policy_engine {
+
+    namespace throttle_keywords {
+        static const std::string throttle{"throttle"};
+        static const std::string operations_per_second{"operations_per_second"};
+        static const std::string bytes_per_second{"bytes_per_second"};
+        static const std::string burst_seconds{"burst_seconds"};
+        static const std::string resources{"resources"};
+    } // throttle_keywords
+
+    // a bucket refilled at a fixed rate holding at most rate * burst tokens.  a request
+    // larger than the capacity waits for a full bucket and then leaves it in debt, so
+    // large objects are admitted at the configured average rate rather than starved
+    class token_bucket {
+    public:
+        token_bucket(double _rate, double _burst_seconds)
+            : rate_{_rate}
+            , capacity_{_rate * std::max(_burst_seconds, 0.001)}
+            , tokens_{capacity_}
+            , last_{clock::now()}
+        {
+        }
+
+        // applies a changed configuration, keeping any tokens which fit the new capacity
+        void configure(double _rate, double _burst_seconds)
+        {
+            std::lock_guard lk{mutex_};
+
+            rate_     = _rate;
+            capacity_ = _rate * std::max(_burst_seconds, 0.001);
+            tokens_   = std::min(tokens_, capacity_);
+        } // configure
+
+        void acquire(double _tokens)
+        {
+            if(_tokens <= 0) {
+                return;
+            }
+
+            std::unique_lock lk{mutex_};
+
+            while(true) {
+                // the rate may be changed by another invocation while this one waits
+                if(rate_ <= 0) {
+                    return;
+                }
+
+                const auto now = clock::now();
+                tokens_ = std::min(capacity_, tokens_ + rate_ * std::chrono::duration<double>(now - last_).count());
+                last_   = now;
+
+                const auto needed = std::min(_tokens, capacity_);
+                if(tokens_ >= needed) {
+                    tokens_ -= _tokens;
+                    return;
+                }
+
+                const auto wait = std::chrono::duration<double>((needed - tokens_) / rate_);
+
+                lk.unlock();
+                std::this_thread::sleep_for(wait);
+                lk.lock();
+            }
+        } // acquire
+
+    private:
+        using clock = std::chrono::steady_clock;
+
+        std::mutex        mutex_;
+        double            rate_;
+        double            capacity_;
+        double            tokens_;
+        clock::time_point last_;
+
+    }; // class token_bucket
+
+    // returns the bucket for a scope and kind of rate, creating it on first use.  there
+    // is one bucket per scope and kind, whose rate follows a changed configuration
+    auto get_token_bucket(
+          const std::string& _scope
+        , const std::string& _kind
+        , double             _rate
+        , double             _burst_seconds) -> token_bucket&
+    {
+        static std::mutex mutex{};
+        static std::map<std::string, std::unique_ptr<token_bucket>> buckets{};
+
+        const auto key = fmt::format("{}:{}", _scope, _kind);
+
+        std::lock_guard lk{mutex};
+        auto& bucket = buckets[key];
+        if(!bucket) {
+            bucket = std::make_unique<token_bucket>(_rate, _burst_seconds);
+        }
+        else {
+            bucket->configure(_rate, _burst_seconds);
+        }
+
+        return *bucket;
+
+    } // get_token_bucket
+
+    // true if a bytes per second rate is configured for the policy or any of the
+    // resources, callers may then skip a catalog lookup for the size of the object
+    auto throttle_requires_size(
+          const nlohmann::json&           _configuration
+        , const std::vector<std::string>& _resources) -> bool
+    {
+        namespace tk = throttle_keywords;
+
+        if(!_configuration.contains(tk::throttle)) {
+            return false;
+        }
+
+        const auto& cfg = _configuration.at(tk::throttle);
+        if(cfg.contains(tk::bytes_per_second)) {
+            return true;
+        }
+
+        if(!cfg.contains(tk::resources)) {
+            return false;
+        }
+
+        const auto& rescs = cfg.at(tk::resources);
+        return std::any_of(_resources.begin(), _resources.end(), [&rescs](const auto& r) {
+            return rescs.contains(r) && rescs.at(r).contains(tk::bytes_per_second);
+        });
+
+    } // throttle_requires_size
+
+    // blocks until the policy and each of the resources admit one operation of the
+    // given size, does nothing if no throttle is configured
+    void apply_throttle(
+          const std::string&              _policy_name
+        , const nlohmann::json&           _configuration
+        , const std::vector<std::string>& _resources
+        , rodsLong_t                      _bytes = 0)
+    {
+        namespace tk = throttle_keywords;
+
+        if(!_configuration.contains(tk::throttle)) {
+            return;
+        }
+
+        const auto& cfg   = _configuration.at(tk::throttle);
+        const auto  burst = cfg.value(tk::burst_seconds, 1.0);
+
+        auto acquire = [&](const std::string& _scope, const nlohmann::json& _rates) {
+            if(_rates.contains(tk::operations_per_second)) {
+                get_token_bucket(_scope, tk::operations_per_second, _rates.at(tk::operations_per_second).get<double>(), burst)
+                    .acquire(1);
+            }
+
+            if(_rates.contains(tk::bytes_per_second)) {
+                get_token_bucket(_scope, tk::bytes_per_second, _rates.at(tk::bytes_per_second).get<double>(), burst)
+                    .acquire(static_cast<double>(_bytes));
+            }
+        };
+
+        acquire(fmt::format("policy:{}", _policy_name), cfg);
+
+        if(!cfg.contains(tk::resources)) {
+            return;
+        }
+
+        const auto& rescs = cfg.at(tk::resources);
+        for(const auto& r : _resources) {
+            if(!r.empty() && rescs.contains(r)) {
+                acquire(fmt::format("resource:{}", r), rescs.at(r));
+            }
+        }
+
+    } // apply_throttle
+
+} // namespace irods::policy_composition::policy_engine
+
+#endif // IRODS_POLICY_ENGINE_THROTTLE_HPP
@@ -0,0 +1,107 @@
+#ifndef IRODS_POLICY_ENGINE_VAULT_USAGE_HPP
+#define IRODS_POLICY_ENGINE_VAULT_USAGE_HPP
+
+#include <irods/irods_resource_backport.hpp>
+#include <irods/irods_resource_manager.hpp>
+#include <irods/irods_exception.hpp>
+#include <irods/rodsLog.h>
+#include <irods/rodsConnect.h>
+
+#include <fmt/format.h>
+#include <boost/filesystem.hpp>
+
+#include <sys/statvfs.h>
+
+#include <cerrno>
+#include <cstdint>
+#include <string>
+
+// The usage of the filesystem holding the vault of a resource, as seen by statvfs on
+// this server.  The policy must therefore be invoked on the server hosting the resource.
+
+extern irods::resource_manager resc_mgr;
+
+namespace irods::policy_composition::policy_engine {
+
+    auto get_vault_path(const std::string& name) -> std::string
+    {
+        rodsLong_t resc_id=0;
+        auto err = resc_mgr.hier_to_leaf_id(name, resc_id);
+        if(!err.ok()) {
+            THROW(err.code(), err.result());
+        }
+
+        std::string vp{};
+
+        err = irods::get_resource_property<std::string>(resc_id, irods::RESOURCE_PATH, vp);
+        if(!err.ok()) {
+            THROW(err.code(), err.result());
+        }
+
+        return vp;
+
+    } // get_vault_path
+
+    // true if the leaf resource of the hierarchy is hosted by this server
+    auto resource_is_local(const std::string& name) -> bool
+    {
+        rodsLong_t resc_id=0;
+        auto err = resc_mgr.hier_to_leaf_id(name, resc_id);
+        if(!err.ok()) {
+            THROW(err.code(), err.result());
+        }
+
+        rodsServerHost_t* host{};
+        err = irods::get_resource_property<rodsServerHost_t*>(resc_id, irods::RESOURCE_HOST, host);
+        if(!err.ok()) {
+            THROW(err.code(), err.result());
+        }
+
+        return host && LOCAL_HOST == host->localFlag;
+
+    } // resource_is_local
+
+    // returns the percentage of the filesystem holding the path which is in use, stating
+    // the nearest existing parent should the path not exist unless walk_to_parent is false
+    auto get_filesystem_percent_used(const std::string& vault_path, bool walk_to_parent = true) -> double
+    {
+        boost::filesystem::path path_to_stat{vault_path};
+        if(!walk_to_parent && !boost::filesystem::exists(path_to_stat)) {
+            THROW(SYS_INVALID_RESC_INPUT,
+                  fmt::format("[{}]: vault path [{}] does not exist"
+                  , __FUNCTION__
+                  , vault_path));
+        }
+
+        while(!boost::filesystem::exists(path_to_stat)) {
+            rodsLog(LOG_NOTICE, "[%s]: path to stat [%s] doesn't exist, moving to parent", __FUNCTION__, path_to_stat.string().c_str());
+            path_to_stat = path_to_stat.parent_path();
+            if (path_to_stat.empty()) {
+                THROW(SYS_INVALID_RESC_INPUT,
+                      fmt::format("[{}]: could not find existing path from given path path [{}]"
+                      , __FUNCTION__
+                      , vault_path));
+            }
+        }
+
+        struct statvfs statvfs_buf;
+        const int statvfs_ret = statvfs(path_to_stat.string().c_str(), &statvfs_buf);
+        if (statvfs_ret != 0) {
+            THROW(SYS_INVALID_RESC_INPUT,
+                  fmt::format("[{}]: statvfs() of [{}] failed with return {} and errno {}"
+                  , __FUNCTION__
+                  , path_to_stat.string()
+                  , statvfs_ret
+                  , errno));
+        }
+
+        uint64_t free_space_blocks  = static_cast<uint64_t>(statvfs_buf.f_bavail);
+        uint64_t total_space_blocks = static_cast<uint64_t>(statvfs_buf.f_blocks);
+
+        return 100.0 * (1.0 - static_cast<double>(free_space_blocks) / static_cast<double>(total_space_blocks));
+
+    } // get_filesystem_percent_used
+
+} // namespace irods::policy_composition::policy_engine
+
+#endif // IRODS_POLICY_ENGINE_VAULT_USAGE_HPP